@@ -0,0 +1,229 @@
+/*
+   dbench harness microbenchmarks
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Measure how fast the dbench harness itself runs, without any backend
+   I/O. This is built and run by "make bench" and shows the maximum op rate
+   dbench can drive before the tool itself becomes the bottleneck.
+
+   child.c is included directly so that its static helpers can be timed
+   on their own.
+*/
+
+#include "child.c"
+
+struct options options = {
+	.timelimit           = 600,
+	.directory           = ".",
+	.nprocs              = 1,
+	.clients_per_process = 1,
+	.run_once            = 1,
+	.skip_cleanup        = 1,
+	.replay_speed        = 1.0,
+};
+struct nb_operations *nb_ops;
+struct nb_operations *backends[MAX_BACKENDS];
+int num_backends;
+int global_random;
+
+#define BENCH_LOOPS 1000000
+#define BENCH_LOADFILE_LINES 100000
+
+static const char *bench_lines[] = {
+	"0.000 NTCreateX \"\\clients\\client1\\~dmtmp\\WORD\\CHAP10.DOC\" 0x4044 0x1 12345 NT_STATUS_OK\n",
+	"0.001 ReadX 12345 *%1048576/4096 4096 4096 NT_STATUS_OK\n",
+	"0.002 WriteX 12345 +4096 4096 4096 NT_STATUS_OK\n",
+	"0.003 QUERY_FILE_INFORMATION 12345 1004 NT_STATUS_OK\n",
+	"0.004 Close 12345 NT_STATUS_OK\n",
+};
+#define NUM_BENCH_LINES (sizeof(bench_lines)/sizeof(bench_lines[0]))
+
+static void report(const char *name, unsigned loops, uint64_t start)
+{
+	double t = nsec_elapsed(start);
+
+	printf(" %-22s %12.0f ops/sec %9.1f ns/op\n",
+		name, loops / t, 1.0e9 * t / loops);
+}
+
+static struct child_struct *bench_child(void)
+{
+	struct child_struct *child;
+
+	child = calloc(1, sizeof(*child));
+	child->num_clients = 1;
+	child->directory = options.directory;
+	child->all_children = child;
+	child->backend = nb_ops;
+	if (asprintf(&child->cname, "client%d", child->id) < 0) {
+		exit(1);
+	}
+	nb_ops->setup(child);
+	return child;
+}
+
+/* split a loadfile line into its parameters */
+static void bench_tokenize(void)
+{
+	char line[MAX_PARM_LEN], params[20][MAX_PARM_LEN];
+	uint64_t start;
+	unsigned i;
+	char *p;
+	int j;
+
+	start = nsec_current();
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		strcpy(line, bench_lines[i % NUM_BENCH_LINES]);
+		p = line;
+		for (j = 0; j < 19 && next_token(&p, params[j], " "); j++)
+			;
+	}
+	report("loadfile tokenize", BENCH_LOOPS, start);
+}
+
+static void bench_parse_special(struct child_struct *child)
+{
+	uint64_t start, val = 0;
+	unsigned i;
+
+	start = nsec_current();
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		val = parse_special(child, (i & 1) ? "*%1048576/4096" : "+4096", val);
+	}
+	report("parse_special", BENCH_LOOPS, start);
+}
+
+static void bench_path_sub(struct child_struct *child)
+{
+	char fname[MAX_PARM_LEN];
+	uint64_t start;
+	unsigned i;
+
+	start = nsec_current();
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		snprintf(fname, sizeof(fname), "%s%s", child->directory,
+			 "/clients/client1/~dmtmp/WORD/CHAP10.DOC");
+		all_string_sub(fname, "client1", child->cname);
+	}
+	report("path substitution", BENCH_LOOPS, start);
+}
+
+/* dispatch both the first and the last command in the fileio table */
+static void bench_child_op(struct child_struct *child)
+{
+	char *params[20];
+	char pbuf[20][MAX_PARM_LEN];
+	uint64_t start;
+	unsigned i;
+
+	for (i = 0; i < 20; i++) {
+		pbuf[i][0] = 0;
+		params[i] = pbuf[i];
+	}
+	strcpy(pbuf[0], "12345");
+	strcpy(pbuf[1], "0");
+	strcpy(pbuf[2], "4096");
+	strcpy(pbuf[3], "4096");
+
+	start = nsec_current();
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		child_op(child, (i & 1) ? "NTCreateX" : "Deltree",
+			 "/clients/client0/file", "", params, "NT_STATUS_OK");
+	}
+	report("child_op dispatch", BENCH_LOOPS, start);
+}
+
+static void bench_finish_op(struct child_struct *child)
+{
+	uint64_t start;
+	unsigned i;
+
+	start = nsec_current();
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		child->lasttime = nsec_current();
+		finish_op(child, &child->ops[i % 17], nsec_current());
+	}
+	report("stats update", BENCH_LOOPS, start);
+}
+
+/* append a trace record, the cost --trace adds to every operation */
+static void bench_trace(struct child_struct *child)
+{
+	uint64_t start;
+	unsigned i;
+
+	if (trace_open("/dev/null") != 0) {
+		exit(1);
+	}
+	trace_setup(child);
+
+	start = nsec_current();
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		trace_op(child, i % 17, (i & 1) ? "/clients/client0/file" :
+			 "/clients/client0/~dmtmp/WORD/CHAP10.DOC",
+			 "NT_STATUS_OK", 4096, nsec_current());
+	}
+	report("trace record", BENCH_LOOPS, start);
+}
+
+/* run a whole loadfile through child_run() against the null backend */
+static void bench_child_run(struct child_struct *child)
+{
+	char loadfile[] = "/tmp/dbench_bench.XXXXXX";
+	uint64_t start;
+	FILE *f;
+	int fd, i;
+
+	fd = mkstemp(loadfile);
+	if (fd == -1 || (f = fdopen(fd, "w")) == NULL) {
+		printf("failed to create %s: %s\n", loadfile, strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < BENCH_LOADFILE_LINES; i++) {
+		/* drop the timestamps so that child_run() does not sleep */
+		fputs(strchr(bench_lines[i % NUM_BENCH_LINES], ' ') + 1, f);
+	}
+	fclose(f);
+
+	start = nsec_current();
+	child_run(child, loadfile);
+	report("child_run end-to-end", BENCH_LOADFILE_LINES, start);
+
+	unlink(loadfile);
+}
+
+int main(void)
+{
+	extern struct nb_operations null_ops;
+	struct child_struct *child;
+
+	setlinebuf(stdout);
+	nb_ops = &null_ops;
+	backends[num_backends++] = nb_ops;
+	child = bench_child();
+
+	printf(" Benchmark                        Rate      Cost\n");
+	printf(" --------------------------------------------------------\n");
+	bench_tokenize();
+	bench_parse_special(child);
+	bench_path_sub(child);
+	bench_child_op(child);
+	bench_finish_op(child);
+	bench_trace(child);
+	bench_child_run(child);
+
+	return 0;
+}
@@ -39,7 +39,7 @@ static void block_setup(struct child_struct *child)
 {
 	int fd;
         
-	child->rate.last_time = timeval_current();
+	child->rate.last_time = timespec_current();
 	child->rate.last_bytes = 0;
 
 	srandom(getpid() ^ time(NULL));
@@ -31,66 +31,184 @@
 #define ival(s) strtoll(s, NULL, 0)
 
 char rw_buf[RWBUFSIZE + 65536];
+int rw_pattern_gen;
 
-static void nb_sleep(int usec)
+static void nb_sleep(struct child_struct *child, int usec)
 {
+	uint64_t t = nsec_current();
+
 	usleep(usec);
+	child->harness.sleep_time += nsec_elapsed(t);
+}
+
+
+/* block until client ch has reached sequence point sp */
+static void nb_wait_sp(struct child_struct *child, int ch, int sp)
+{
+	int *seq = &child->all_children[ch].sequence_point;
+	uint64_t t = nsec_current();
+	int cur;
+
+	while ((cur = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) != sp &&
+	       !child->done) {
+		futex_wait(seq, cur, 1.0);
+	}
+	child->harness.sleep_time += nsec_elapsed(t);
+}
+
+static void nb_set_sp(struct child_struct *child, int sp)
+{
+	__atomic_store_n(&child->sequence_point, sp, __ATOMIC_RELEASE);
+	futex_wake(&child->sequence_point);
+}
+
+/* block until count client processes have reached barrier id */
+static void nb_barrier(struct child_struct *child, int id, int count)
+{
+	struct barrier *b = &child->barriers[id];
+	uint64_t t = nsec_current();
+	int gen;
+
+	gen = __atomic_load_n(&b->generation, __ATOMIC_ACQUIRE);
+	if (__atomic_add_fetch(&b->arrived[gen & 1], 1, __ATOMIC_ACQ_REL) >= count) {
+		/* the last one to arrive releases the others. The count of
+		   the next generation is cleared first, so no arrival for it
+		   can be lost, while late arrivals for this one go to a
+		   count that is cleared before it is used again */
+		__atomic_store_n(&b->arrived[(gen + 1) & 1], 0, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&b->generation, 1, __ATOMIC_ACQ_REL);
+		futex_wake(&b->generation);
+	} else {
+		while (__atomic_load_n(&b->generation, __ATOMIC_ACQUIRE) == gen &&
+		       !child->done) {
+			futex_wait(&b->generation, gen, 1.0);
+		}
+	}
+	child->harness.sleep_time += nsec_elapsed(t);
 }
 
+/* sleep until an absolute deadline and record how far off it we woke up */
+static void nb_sleep_until(struct child_struct *child, struct timespec *deadline)
+{
+	uint64_t t = nsec_current();
+	double late;
+
+	late = sleep_until(deadline);
+	child->harness.sleep_time += nsec_elapsed(t);
+
+	child->pacing.count++;
+	child->pacing.total_error += late;
+	if (late > child->pacing.max_error) {
+		child->pacing.max_error = late;
+	}
+}
 
 static void nb_target_rate(struct child_struct *child, double rate)
 {
 	double tdelay;
+	struct timespec deadline;
 
 	if (child->rate.last_bytes == 0) {
 		child->rate.last_bytes = child->bytes;
-		child->rate.last_time = timeval_current();
+		child->rate.last_time = timespec_current();
 		return;
 	}
 
 	if (rate != 0) {
 		tdelay = (child->bytes - child->rate.last_bytes)/(1.0e6*rate) - 
-			timeval_elapsed(&child->rate.last_time);
+			timespec_elapsed(&child->rate.last_time);
 	} else {
-		tdelay = - timeval_elapsed(&child->rate.last_time);
+		tdelay = - timespec_elapsed(&child->rate.last_time);
 	}
 	if (tdelay > 0 && rate != 0) {
-		msleep(tdelay*1000);
+		deadline = child->rate.last_time;
+		timespec_add(&deadline, (child->bytes - child->rate.last_bytes)/(1.0e6*rate));
+		nb_sleep_until(child, &deadline);
 	} else {
 		child->max_latency = MAX(child->max_latency, -tdelay);
 	}
 
-	child->rate.last_time = timeval_current();
+	child->rate.last_time = timespec_current();
 	child->rate.last_bytes = child->bytes;
 }
 
 static void nb_time_reset(struct child_struct *child)
 {
-	child->starttime = timeval_current();	
+	child->starttime = timespec_current();	
 	memset(&child->rate, 0, sizeof(child->rate));
+	memset(&child->replay, 0, sizeof(child->replay));
 }
 
 static void nb_time_delay(struct child_struct *child, double targett)
 {
-	double elapsed = timeval_elapsed(&child->starttime);
+	double elapsed;
+	struct timespec deadline;
+
+	targett /= options.replay_speed;
+
+	/* shorten gaps between bursts to at most compress_idle seconds of
+	   replay time, keeping the spacing inside the bursts */
+	if (options.compress_idle > 0) {
+		if (targett - child->replay.last > options.compress_idle) {
+			child->replay.skipped += targett - child->replay.last - options.compress_idle;
+		}
+		child->replay.last = targett;
+		targett -= child->replay.skipped;
+	}
+
+	elapsed = timespec_elapsed(&child->starttime);
 	if (targett > elapsed) {
-		msleep(1000*(targett - elapsed));
+		deadline = child->starttime;
+		timespec_add(&deadline, targett);
+		nb_sleep_until(child, &deadline);
 	} else if (elapsed - targett > child->max_latency) {
 		child->max_latency = MAX(elapsed - targett, child->max_latency);
 	}
 }
 
-static void finish_op(struct child_struct *child, struct op *op)
+/* account an op that started at child->lasttime and ended at end */
+static void finish_op(struct child_struct *child, struct op *op, uint64_t end)
 {
-	double t = timeval_elapsed(&child->lasttime);
+	double t = (end - child->lasttime) * 1.0e-9;
 	op->count++;
 	op->total_time += t;
 	if (t > op->max_latency) {
 		op->max_latency = t;
 	}
+	op->hist[latency_bucket(t)]++;
+}
+
+#ifdef RUSAGE_THREAD
+#define RUSAGE_OP RUSAGE_THREAD
+#else
+#define RUSAGE_OP RUSAGE_SELF
+#endif
+
+/* add the CPU time and context switches used since ru0 to an op */
+static void finish_op_cpu(struct op *op, struct rusage *ru0)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_OP, &ru);
+	op->user_time += timeval_elapsed2(&ru0->ru_utime, &ru.ru_utime);
+	op->sys_time += timeval_elapsed2(&ru0->ru_stime, &ru.ru_stime);
+	op->vol_cs += ru.ru_nvcsw - ru0->ru_nvcsw;
+	op->invol_cs += ru.ru_nivcsw - ru0->ru_nivcsw;
+}
+
+/* add the hardware counter deltas since perf0 to an op */
+static void finish_op_perf(struct op *op, uint64_t *perf0)
+{
+	uint64_t perf[NUM_PERF_COUNTERS];
+	int i;
+
+	perf_read(perf);
+	for (i = 0; i < NUM_PERF_COUNTERS; i++) {
+		op->perf[i] += perf[i] - perf0[i];
+	}
 }
 
-#define OP_LATENCY(opname) finish_op(child, &child->op.op_ ## opname)
+#define OP_LATENCY(opname) finish_op(child, &child->op.op_ ## opname, nsec_current())
 
 /* here we parse "special" arguments that start with '*'
  * '*' itself means a random 64 bit number, but this can be qualified as
@@ -183,10 +301,12 @@ static void child_op(struct child_struct *child, const char *opname,
 {
 	static struct dbench_op prev_op;
 	struct dbench_op op;
+	struct rusage ru;
+	uint64_t perf[NUM_PERF_COUNTERS];
+	double bytes;
+	uint64_t end;
 	unsigned i;
 
-	child->lasttime = timeval_current();
-
 	ZERO_STRUCT(op);
 	op.child = child;
 	op.op = opname;
@@ -208,8 +328,38 @@ static void child_op(struct child_struct *child, const char *opname,
 
 	for (i=0;nb_ops->ops[i].name;i++) {
 		if (strcasecmp(op.op, nb_ops->ops[i].name) == 0) {
+			if (nb_ops->before_op) {
+				nb_ops->before_op(&op, &nb_ops->ops[i]);
+			}
+			if (options.cpu_stats) {
+				getrusage(RUSAGE_OP, &ru);
+			}
+			if (options.perf_counters) {
+				perf_read(perf);
+			}
+			if (options.stall_threshold > 0) {
+				snprintf(child->current.op, sizeof(child->current.op), "%s", op.op);
+				snprintf(child->current.fname, sizeof(child->current.fname), "%s", op.fname);
+			}
+			bytes = child->bytes;
+			child->lasttime = nsec_current();
+			child->current.in_op = 1;
 			nb_ops->ops[i].fn(&op);
-			finish_op(child, &child->ops[i]);
+			end = nsec_current();
+			child->current.in_op = 0;
+			finish_op(child, &child->ops[i], end);
+			if (options.perf_counters) {
+				finish_op_perf(&child->ops[i], perf);
+			}
+			if (options.cpu_stats) {
+				finish_op_cpu(&child->ops[i], &ru);
+			}
+			/* after the accounting, so that recording the op and
+			   flushing the buffer do not add to its latency */
+			if (options.trace) {
+				trace_op(child, i, op.fname, op.status,
+					 child->bytes - bytes, end);
+			}
 			return;
 		}
 	}
@@ -218,6 +368,57 @@ static void child_op(struct child_struct *child, const char *opname,
 	       child->line, op.op, (unsigned)getpid());
 }
 
+/* loadfile paths shared by all clients, "client1" is not replaced in
+   them */
+#define MAX_SHARED 16
+static char *shared_prefix[MAX_SHARED];
+static unsigned num_shared;
+
+static int add_shared_prefix(const char *prefix)
+{
+	char *p;
+	unsigned i;
+
+	p = strdup(prefix[0] == '"' ? prefix + 1 : prefix);
+	if (p[0] && p[strlen(p)-1] == '"') {
+		p[strlen(p)-1] = 0;
+	}
+	all_string_sub(p, "\\", "/");
+
+	/* the directive is seen again every time the loadfile restarts */
+	for (i = 0; i < num_shared; i++) {
+		if (strcmp(shared_prefix[i], p) == 0) {
+			free(p);
+			return 0;
+		}
+	}
+	if (num_shared == MAX_SHARED) {
+		fprintf(stderr, "Too many shared prefixes, %u is maximum\n", MAX_SHARED);
+		free(p);
+		return 1;
+	}
+	shared_prefix[num_shared++] = p;
+	return 0;
+}
+
+static int is_shared(const char *path)
+{
+	unsigned i;
+
+	for (i = 0; i < num_shared; i++) {
+		if (strncmp(path, shared_prefix[i], strlen(shared_prefix[i])) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* the shared prefix i, or NULL past the last one */
+const char *get_shared_prefix(unsigned i)
+{
+	return i < num_shared ? shared_prefix[i] : NULL;
+}
+
 #define MAX_RND_STR 10
 static char random_string[MAX_RND_STR][256];
 
@@ -341,6 +542,9 @@ void child_run(struct child_struct *child0, const char *loadfile)
 		if (asprintf(&child->cname, "client%d", child->id) < 0) {
 			exit(1);
 		}
+		if (options.trace) {
+			trace_setup(child);
+		}
 	}
 
 	sparams = calloc(20, sizeof(char *));
@@ -349,11 +553,25 @@ void child_run(struct child_struct *child0, const char *loadfile)
 		memset(sparams[i], 0, MAX_PARM_LEN);
 	}
 
-again:
+	if (options.shared_prefix && num_shared == 0) {
+		char *prefixes = strdup(options.shared_prefix), *prefix;
+
+		for (prefix = strtok(prefixes, ","); prefix; prefix = strtok(NULL, ",")) {
+			if (add_shared_prefix(prefix) != 0) {
+				exit(1);
+			}
+		}
+		free(prefixes);
+	}
+
+	child0->harness.start = nsec_current();
+
+restart:
 	for (child=child0;child<child0+options.clients_per_process;child++) {
 		nb_time_reset(child);
 	}
 
+again:
 	while (gzgets(gzf, line, sizeof(line)-1)) {
 		unsigned repeat_count = 1;
 
@@ -422,7 +640,7 @@ loop_again:
 					"line %d\n", child0->line);
 				goto done;
 			}
-			nb_sleep(sleep_count);
+			nb_sleep(child0, sleep_count);
 			goto again;
 		}
 
@@ -433,7 +651,7 @@ loop_again:
 					"line %d\n", child0->line);
 				goto done;
 			}
-			child0->sequence_point = sp;
+			nb_set_sp(child0, sp);
 			goto again;
 		}
 
@@ -444,9 +662,19 @@ loop_again:
 					"line %d\n", child0->line);
 				goto done;
 			}
-			while (child0->all_children[ch].sequence_point != sp) {
-				nb_sleep(1000);
+			nb_wait_sp(child0, ch, sp);
+			goto again;
+		}
+
+		if (strncmp(line, "BARRIER", 7) == 0) {
+			int id, count;
+			if (sscanf(line, "BARRIER %d %d\n", &id, &count) != 2 ||
+			    id < 0 || id >= MAX_BARRIERS || count < 1) {
+				fprintf(stderr, "Incorrect BARRIER at "
+					"line %d\n", child0->line);
+				goto done;
 			}
+			nb_barrier(child0, id, count);
 			goto again;
 		}
 
@@ -467,10 +695,22 @@ loop_again:
 			      ptr += len;
 			      count -= len;
 			}
+			rw_pattern_gen++;
 			goto again;
 		}
 
 
+		/* SHARED <prefix> */
+		if (strncmp(line, "SHARED", 6) == 0) {
+			char prefix[MAX_PARM_LEN];
+			if (sscanf(line, "SHARED %s\n", prefix) != 1 ||
+			    add_shared_prefix(prefix) != 0) {
+				fprintf(stderr, "Incorrect SHARED at line %d\n", child0->line);
+				goto done;
+			}
+			goto again;
+		}
+
 		/* RANDOMSTRING */
 		if (strncmp(line, "RANDOMSTRING", 12) == 0) {
 			have_random = 1;
@@ -543,18 +783,27 @@ loop_again:
 		for (child=child0;child<child0+options.clients_per_process;child++) {
 			unsigned child_repeat_count = repeat_count;
 			int pcount = 1;
+			int shared = 0;
 
 			fname[0] = 0;
 			fname2[0] = 0;
 
 			if (i>1 && params[1][0] == '/') {
 				snprintf(fname, sizeof(fname), "%s%s", child->directory, params[1]);
-				all_string_sub(fname,"client1", child->cname);
+				if (num_shared && is_shared(params[1])) {
+					shared = 1;
+				} else {
+					all_string_sub(fname,"client1", child->cname);
+				}
 				pcount++;
 			}
 			if (i>2 && params[2][0] == '/') {
 				snprintf(fname2, sizeof(fname2), "%s%s", child->directory, params[2]);
-				all_string_sub(fname2,"client1", child->cname);
+				if (num_shared && is_shared(params[2])) {
+					shared = 1;
+				} else {
+					all_string_sub(fname2,"client1", child->cname);
+				}
 				pcount++;
 			}
 
@@ -563,8 +812,11 @@ loop_again:
 			} else {
 				nb_time_delay(child, targett);
 			}
+			/* other clients may get to a shared path first, so
+			   accept any result */
 			while (child_repeat_count--) {
-				child_op(child, params[0], fname, fname2, params+pcount, status);
+				child_op(child, params[0], fname, fname2, params+pcount,
+					 shared ? "*" : status);
 			}
 		}
 	}
@@ -573,16 +825,28 @@ loop_again:
 		goto done;
 	}
 
+	if (options.drop_between_loads && nb_ops->drop_cache) {
+		for (child=child0;child<child0+options.clients_per_process;child++) {
+			nb_ops->drop_cache(child);
+		}
+	}
+
 	gzrewind(gzf);
-	goto again;
+	goto restart;
 
 done:
+	child0->harness.end = nsec_current();
 	gzclose(gzf);
 	for (child=child0;child<child0+options.clients_per_process;child++) {
+		if (options.trace) {
+			trace_flush(child);
+		}
 		child->cleanup = 1;
 		fflush(stdout);
 		if (!options.skip_cleanup) {
+			child->cleanup_time.start = nsec_current();
 			nb_ops->cleanup(child);
+			child->cleanup_time.end = nsec_current();
 		}
 		child->cleanup_finished = 1;
 		if(child->cname){
@@ -28,6 +28,7 @@
 #include "dbench.h"
 #include <argp.h>
 #include <zlib.h>
+#include <math.h>
 
 struct options options = {
 	.timelimit           = 600,
@@ -37,7 +38,6 @@ struct options options = {
 	.sync_open           = 0,
 	.sync_dirs           = 0,
 	.do_fsync            = 0,
-	.fsync_frequency     = 0,
 	.warmup              = -1,
 	.targetrate          = 0.0,
 	.ea_enable           = 0,
@@ -50,12 +50,18 @@ struct options options = {
 	.iscsi_initiatorname = "iqn.2011-09.org.samba.dbench:client",
 #endif
 	.machine_readable    = 0,
+	.stall_log           = "dbench-stalls.log",
+	.heatmap_format      = "text",
+	.replay_speed        = 1.0,
+	.cleanup_workers     = 1,
 };
 
-static struct timeval tv_start;
-static struct timeval tv_end;
+static struct timespec tv_start;
+static struct timespec tv_end;
 static double throughput;
 struct nb_operations *nb_ops;
+struct nb_operations *backends[MAX_BACKENDS];
+int num_backends;
 int global_random;
 
 static int check_loadfile(char *loadfile)
@@ -75,6 +81,76 @@ static int check_loadfile(char *loadfile)
 
 static struct child_struct *children;
 
+/* append the contents of a /proc file to the stall log */
+static void log_proc_file(FILE *log, pid_t pid, const char *name)
+{
+	char path[64], buf[1024];
+	size_t n;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%u/%s", (unsigned)pid, name);
+	fprintf(log, "%s:\n", name);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(log, "  unavailable: %s\n", strerror(errno));
+		return;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		fwrite(buf, 1, n, log);
+	}
+	if (strcmp(name, "wchan") == 0) {
+		fprintf(log, "\n");
+	}
+	fclose(f);
+}
+
+/* report every client that has been stuck in a single operation for
+   longer than --stall-threshold */
+static void check_stalls(uint64_t tnow_ns)
+{
+	int nclients = options.nprocs * options.clients_per_process;
+	static FILE *log;
+	struct child_struct *child;
+	uint64_t lasttime;
+	double stalled;
+	int i;
+
+	for (i=0;i<nclients;i++) {
+		child = &children[i];
+		lasttime = child->lasttime;
+		if (!child->current.in_op || lasttime >= tnow_ns ||
+		    lasttime == child->current.reported) {
+			continue;
+		}
+		stalled = (tnow_ns - lasttime) * 1.0e-9;
+		if (stalled < options.stall_threshold) {
+			continue;
+		}
+		child->current.reported = lasttime;
+
+		printf("client %d stalled for %.03f sec in %s at line %d, see %s\n",
+			child->id, stalled, child->current.op, child->line,
+			options.stall_log);
+
+		if (log == NULL) {
+			log = fopen(options.stall_log, "a");
+			if (log == NULL) {
+				printf("failed to open stall log %s: %s\n",
+					options.stall_log, strerror(errno));
+				options.stall_threshold = 0;
+				return;
+			}
+		}
+		fprintf(log, "STALL client %d pid %u line %d op %s path %s stalled %.03f sec\n",
+			child->id, (unsigned)child->pid, child->line,
+			child->current.op, child->current.fname, stalled);
+		log_proc_file(log, child->pid, "wchan");
+		log_proc_file(log, child->pid, "stack");
+		fprintf(log, "\n");
+		fflush(log);
+	}
+}
+
 static void sig_alarm(int sig)
 {
 	double total_bytes = 0;
@@ -85,12 +161,14 @@ static void sig_alarm(int sig)
 	double t;
 	static int in_cleanup;
 	double latency;
-	struct timeval tnow;
+	struct timespec tnow;
+	uint64_t tnow_ns;
 	int num_active = 0;
 	int num_finished = 0;
 	(void)sig;
 
-	tnow = timeval_current();
+	tnow = timespec_current();
+	tnow_ns = nsec_current();
 
 	for (i=0;i<nclients;i++) {
 		total_bytes += children[i].bytes - children[i].bytes_done_warmup;
@@ -105,7 +183,7 @@ static void sig_alarm(int sig)
 		}
 	}
 
-	t = timeval_elapsed(&tv_start);
+	t = timespec_elapsed(&tv_start);
 
 	if (!in_warmup && options.warmup>0 && t > options.warmup) {
 		tv_start = tnow;
@@ -114,6 +192,11 @@ static void sig_alarm(int sig)
 			children[i].bytes_done_warmup = children[i].bytes;
 			children[i].worst_latency = 0;
 			memset(&children[i].ops, 0, sizeof(children[i].ops));
+			memset(&children[i].pacing, 0, sizeof(children[i].pacing));
+			if (children[i].harness.start != 0) {
+				children[i].harness.start = tnow_ns;
+			}
+			children[i].harness.sleep_time = 0;
 		}
 		goto next;
 	}
@@ -134,7 +217,9 @@ static void sig_alarm(int sig)
 	if (!in_cleanup) {
 		for (i=0;i<nclients;i++) {
 			latency = MAX(children[i].max_latency, latency);
-			latency = MAX(latency, timeval_elapsed2(&children[i].lasttime, &tnow));
+			if (tnow_ns > children[i].lasttime) {
+				latency = MAX(latency, (tnow_ns - children[i].lasttime) * 1.0e-9);
+			}
 			children[i].max_latency = 0;
 			if (latency > children[i].worst_latency) {
 				children[i].worst_latency = latency;
@@ -173,6 +258,24 @@ static void sig_alarm(int sig)
 		}
 	}
 
+	if (options.sys_stats) {
+		sys_stats_report();
+	}
+
+	if (options.stall_threshold > 0 && !in_cleanup) {
+		check_stalls(tnow_ns);
+	}
+
+	if (options.heatmap && !in_warmup && !in_cleanup) {
+		heatmap_sample(children, nclients, t);
+	}
+
+	if (options.metrics) {
+		metrics_serve(children, nclients,
+			      in_warmup ? "warmup" : in_cleanup ? "cleanup" : "execute",
+			      num_active, 1.0e-6 * total_bytes / t);
+	}
+
 	fflush(stdout);
 next:
 	signal(SIGALRM, sig_alarm);
@@ -180,24 +283,25 @@ next:
 }
 
 
-static void show_one_latency(struct op *ops, struct op *ops_all)
+static void show_one_latency(struct nb_operations *backend,
+			     struct op *ops, struct op *ops_all)
 {
 	int i;
 	printf(" Operation                Count    AvgLat    MaxLat\n");
 	printf(" --------------------------------------------------\n");
-	for (i=0;nb_ops->ops[i].name;i++) {
+	for (i=0;backend->ops[i].name;i++) {
 		struct op *op1, *op_all;
 		op1    = &ops[i];
 		op_all = &ops_all[i];
 		if (op_all->count == 0) continue;
 		if (options.machine_readable) {
 			printf(":%s:%u:%.03f:%.03f:\n",
-				nb_ops->ops[i].name, op1->count,
+				backend->ops[i].name, op1->count,
 				1000*op1->total_time/op1->count,
 				op1->max_latency*1000);
 		} else {
 			printf(" %-22s %7u %9.03f %9.03f\n",
-				nb_ops->ops[i].name, op1->count,
+				backend->ops[i].name, op1->count,
 				1000*op1->total_time/op1->count,
 				op1->max_latency*1000);
 		}
@@ -205,25 +309,523 @@ static void show_one_latency(struct op *ops, struct op *ops_all)
 	printf("\n");
 }
 
-static void report_latencies(void)
+/* report how accurately the clients hit their sleep deadlines */
+static void report_pacing(void)
+{
+	unsigned count = 0;
+	double total_error = 0;
+	double max_error = 0;
+	int i;
+
+	for (i=0;i<options.nprocs * options.clients_per_process;i++) {
+		count += children[i].pacing.count;
+		total_error += children[i].pacing.total_error;
+		max_error = MAX(max_error, children[i].pacing.max_error);
+	}
+	if (count == 0) {
+		return;
+	}
+
+	if (options.machine_readable) {
+		printf(":Pacing:%u:%.03f:%.03f:\n",
+			count, 1.0e6*total_error/count, 1.0e6*max_error);
+	} else {
+		printf(" Pacing error: %u sleeps, avg %.03f us, max %.03f us\n\n",
+			count, 1.0e6*total_error/count, 1.0e6*max_error);
+	}
+}
+
+/* average hardware counter values per operation */
+static void report_perf(struct nb_operations *backend, struct op *sum)
 {
-	struct op sum[MAX_OPS];
 	int i, j;
+
+	printf(" Operation             ");
+	for (j=0;j<NUM_PERF_COUNTERS;j++) {
+		printf(" %12s", perf_counter_names[j]);
+	}
+	printf("      IPC\n");
+	printf(" ----------------------------------------------------------------------------------\n");
+	for (i=0;backend->ops[i].name;i++) {
+		struct op *op1 = &sum[i];
+
+		if (op1->count == 0) continue;
+		if (options.machine_readable) {
+			printf(":%s:", backend->ops[i].name);
+			for (j=0;j<NUM_PERF_COUNTERS;j++) {
+				printf("%.0f:", (double)op1->perf[j]/op1->count);
+			}
+			printf("\n");
+			continue;
+		}
+		printf(" %-22s", backend->ops[i].name);
+		for (j=0;j<NUM_PERF_COUNTERS;j++) {
+			printf(" %12.0f", (double)op1->perf[j]/op1->count);
+		}
+		printf(" %8.2f\n", op1->perf[PERF_CTR_CYCLES] ?
+			(double)op1->perf[PERF_CTR_INSTRUCTIONS]/op1->perf[PERF_CTR_CYCLES] : 0);
+	}
+	printf("\n");
+}
+
+/* client CPU time and context switches spent inside each operation */
+static void report_cpu(struct nb_operations *backend, struct op *sum)
+{
+	double user_time = 0, sys_time = 0, total_bytes = 0;
+	int i;
+
+	printf(" Operation                 UserCPU    SysCPU     VolCS   InvolCS\n");
+	printf(" ---------------------------------------------------------------\n");
+	for (i=0;backend->ops[i].name;i++) {
+		struct op *op1 = &sum[i];
+
+		if (op1->count == 0) continue;
+		user_time += op1->user_time;
+		sys_time += op1->sys_time;
+		if (options.machine_readable) {
+			printf(":%s:%.03f:%.03f:%.03f:%.03f:\n",
+				backend->ops[i].name,
+				1.0e6*op1->user_time/op1->count,
+				1.0e6*op1->sys_time/op1->count,
+				(double)op1->vol_cs/op1->count,
+				(double)op1->invol_cs/op1->count);
+		} else {
+			printf(" %-22s %9.03f %9.03f %9.03f %9.03f\n",
+				backend->ops[i].name,
+				1.0e6*op1->user_time/op1->count,
+				1.0e6*op1->sys_time/op1->count,
+				(double)op1->vol_cs/op1->count,
+				(double)op1->invol_cs/op1->count);
+		}
+	}
+
+	for (i=0;i<options.nprocs * options.clients_per_process;i++) {
+		if (children[i].backend == backend) {
+			total_bytes += children[i].bytes - children[i].bytes_done_warmup;
+		}
+	}
+	if (user_time + sys_time > 0) {
+		printf(" CPU %.03f sec user, %.03f sec sys, %.2f MB/sec per client CPU core\n",
+			user_time, sys_time,
+			1.0e-6 * total_bytes / (user_time + sys_time));
+	}
+	printf("\n");
+}
+
+static double tput_min(double *v, int n)
+{
+	double m = v[0];
+	int i;
+
+	for (i=1;i<n;i++) {
+		m = MIN(m, v[i]);
+	}
+	return m;
+}
+
+static double tput_max(double *v, int n)
+{
+	double m = v[0];
+	int i;
+
+	for (i=1;i<n;i++) {
+		m = MAX(m, v[i]);
+	}
+	return m;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/* summarise how evenly throughput and latency were shared between the
+   clients. This is readable for hundreds of clients, unlike
+   --per-client-results */
+#define STARVATION_FRACTION 0.1
+static void report_fairness(void)
+{
+	int nclients = options.nprocs * options.clients_per_process;
+	double *tput, *p99;
+	double sum = 0, sum2 = 0, mean, stddev, jain;
+	unsigned hist[LAT_HIST_BUCKETS];
+	struct timespec tnow = timespec_current();
+	struct timespec *tend = tv_end.tv_sec ? &tv_end : &tnow;
+	double runtime = timespec_elapsed2(&tv_start, tend);
+	int use_ops = 1;
+	int starved = 0;
+	int i, j, k;
+
+	if (runtime <= 0) {
+		return;
+	}
+
+	/* compare bytes if the load moved any data, operations otherwise */
+	for (i=0;i<nclients;i++) {
+		if (children[i].bytes - children[i].bytes_done_warmup > 0) {
+			use_ops = 0;
+		}
+	}
+
+	tput = calloc(nclients, sizeof(double));
+	p99 = calloc(nclients, sizeof(double));
+	for (i=0;i<nclients;i++) {
+		struct child_struct *child = &children[i];
+
+		memset(hist, 0, sizeof(hist));
+		for (j=0;child->backend->ops[j].name;j++) {
+			if (use_ops) {
+				tput[i] += child->ops[j].count;
+			}
+			for (k=0;k<LAT_HIST_BUCKETS;k++) {
+				hist[k] += child->ops[j].hist[k];
+			}
+		}
+		if (!use_ops) {
+			tput[i] = 1.0e-6 * (child->bytes - child->bytes_done_warmup);
+		}
+		tput[i] /= runtime;
+		p99[i] = latency_percentile(hist, 99);
+		sum += tput[i];
+		sum2 += tput[i] * tput[i];
+	}
+
+	mean = sum / nclients;
+	stddev = sqrt(MAX(0, sum2 / nclients - mean * mean));
+	jain = sum2 > 0 ? sum * sum / (nclients * sum2) : 1;
+	for (i=0;i<nclients;i++) {
+		if (tput[i] < STARVATION_FRACTION * mean) {
+			starved++;
+		}
+	}
+
+	/* tput[] stays in client order so starved clients can be listed */
+	qsort(p99, nclients, sizeof(double), cmp_double);
+
+	if (options.machine_readable) {
+		printf(":Fairness:%s:%.4f:%.3f:%.3f:%.3f:%.3f:%d:\n",
+			use_ops ? "ops" : "MB",
+			jain, tput_min(tput, nclients), tput_max(tput, nclients),
+			mean, stddev, starved);
+		printf(":P99:%.03f:%.03f:%.03f:%.03f:\n",
+			1000*p99[0], 1000*p99[nclients/2],
+			1000*p99[(nclients*9)/10], 1000*p99[nclients-1]);
+	} else {
+		printf(" Fairness over %d clients (%s/sec per client)\n",
+			nclients, use_ops ? "ops" : "MB");
+		printf("  Jain's index %.4f  min %.3f  max %.3f  mean %.3f  stddev %.3f\n",
+			jain, tput_min(tput, nclients), tput_max(tput, nclients),
+			mean, stddev);
+		printf("  per-client p99 latency ms: min %.03f  median %.03f  p90 %.03f  max %.03f\n",
+			1000*p99[0], 1000*p99[nclients/2],
+			1000*p99[(nclients*9)/10], 1000*p99[nclients-1]);
+		printf("  %d clients starved (below %.0f%% of mean throughput)",
+			starved, 100 * STARVATION_FRACTION);
+		for (i=0, j=0;i<nclients && j<10;i++) {
+			if (tput[i] < STARVATION_FRACTION * mean) {
+				printf("%s%d", j++ ? "," : ": ", i);
+			}
+		}
+		printf("%s\n\n", starved > 10 ? ",..." : "");
+	}
+
+	free(tput);
+	free(p99);
+}
+
+/* the time the clients took to remove their files after the run, which
+   is not part of the results */
+static void report_cleanup(void)
+{
+	uint64_t start = 0, end = 0;
+	double slowest = 0;
+	int i;
+
+	for (i=0;i<options.nprocs * options.clients_per_process;i++) {
+		struct child_struct *child = &children[i];
+
+		if (child->cleanup_time.end == 0) {
+			continue;
+		}
+		if (start == 0 || child->cleanup_time.start < start) {
+			start = child->cleanup_time.start;
+		}
+		end = MAX(end, child->cleanup_time.end);
+		slowest = MAX(slowest, (child->cleanup_time.end -
+					child->cleanup_time.start) * 1.0e-9);
+	}
+	if (end == 0) {
+		return;
+	}
+
+	if (options.machine_readable) {
+		printf(":Cleanup:%.3f:%.3f:\n", (end - start) * 1.0e-9, slowest);
+	} else {
+		printf(" Cleanup took %.3f sec, %.3f sec for the slowest client\n\n",
+			(end - start) * 1.0e-9, slowest);
+	}
+}
+
+/* split the time the clients were not sleeping into time spent inside
+   the backend operations and time spent in dbench itself */
+static void report_harness(void)
+{
+	double wall = 0, sleep_time = 0, backend = 0;
+	unsigned count = 0;
+	int i, j;
+
+	for (i=0;i<options.nprocs * options.clients_per_process;i++) {
+		struct child_struct *child = &children[i];
+
+		if (child->harness.start != 0 && child->harness.end != 0) {
+			wall += (child->harness.end - child->harness.start) * 1.0e-9;
+		}
+		sleep_time += child->harness.sleep_time;
+		for (j=0;child->backend->ops[j].name;j++) {
+			count += child->ops[j].count;
+			backend += child->ops[j].total_time;
+		}
+	}
+	if (count == 0) {
+		return;
+	}
+
+	if (options.machine_readable) {
+		printf(":Harness:%u:%.0f:%.0f:\n",
+			count, 1.0e9*(wall - sleep_time - backend)/count,
+			1.0e9*backend/count);
+	} else {
+		printf(" Harness: %u ops, %.0f ns/op in dbench, %.0f ns/op in backend\n\n",
+			count, 1.0e9*(wall - sleep_time - backend)/count,
+			1.0e9*backend/count);
+	}
+}
+
+/* add up the operations of all clients using a backend */
+static void sum_ops(struct nb_operations *backend, struct op *sum)
+{
+	int i, j, k;
 	struct op *op1, *op2;
-	struct child_struct *child;
 
-	memset(sum, 0, sizeof(sum));
-	for (i=0;nb_ops->ops[i].name;i++) {
+	memset(sum, 0, sizeof(struct op) * MAX_OPS);
+	for (i=0;backend->ops[i].name;i++) {
 		op1 = &sum[i];
 		for (j=0;j<options.nprocs * options.clients_per_process;j++) {
-			child = &children[j];
-			op2 = &child->ops[i];
+			if (children[j].backend != backend) {
+				continue;
+			}
+			op2 = &children[j].ops[i];
 			op1->count += op2->count;
 			op1->total_time += op2->total_time;
 			op1->max_latency = MAX(op1->max_latency, op2->max_latency);
+			op1->user_time += op2->user_time;
+			op1->sys_time += op2->sys_time;
+			op1->vol_cs += op2->vol_cs;
+			op1->invol_cs += op2->invol_cs;
+			for (k=0;k<NUM_PERF_COUNTERS;k++) {
+				op1->perf[k] += op2->perf[k];
+			}
+			for (k=0;k<LAT_HIST_BUCKETS;k++) {
+				op1->hist[k] += op2->hist[k];
+			}
 		}
 	}
-	show_one_latency(sum, sum);
+}
+
+static const char *counter_names[NUM_COUNTERS] = {
+	[COUNTER_DIRECT_IO] = "Direct I/Os",
+	[COUNTER_DIRECT_UNALIGNED] = "Unaligned direct I/Os",
+	[COUNTER_DIR_SCAN] = "Directory scans",
+	[COUNTER_DIR_SCAN_ENTRIES] = "Directory entries read",
+	[COUNTER_NAME_CACHE_HIT] = "Name cache hits",
+	[COUNTER_NAME_CACHE_MISS] = "Name cache misses",
+	[COUNTER_DIRFD_OPEN] = "Directory fds opened",
+	[COUNTER_PATH_COMPONENTS_SAVED] = "Path components saved",
+	[COUNTER_HINT_SEQUENTIAL] = "Sequential access hints",
+	[COUNTER_HINT_RANDOM] = "Random access hints",
+	[COUNTER_MMAP_WINDOW] = "Mmap windows mapped",
+	[COUNTER_MMAP_FALLBACK] = "Mmap syscall fallbacks",
+	[COUNTER_CACHE_DROP] = "Page cache drops",
+	[COUNTER_CACHE_PAGES_SAMPLED] = "Read pages sampled",
+	[COUNTER_CACHE_PAGES_RESIDENT] = "Read pages in cache",
+};
+
+/* the events counted by the backends */
+static void report_counters(void)
+{
+	uint64_t sum[NUM_COUNTERS];
+	int i, j, found = 0;
+
+	memset(sum, 0, sizeof(sum));
+	for (i=0;i<options.nprocs * options.clients_per_process;i++) {
+		for (j=0;j<NUM_COUNTERS;j++) {
+			sum[j] += children[i].counters[j];
+			found |= sum[j] != 0;
+		}
+	}
+	if (!found) {
+		return;
+	}
+
+	if (!options.machine_readable) {
+		printf(" Counter                          Count\n");
+		printf(" --------------------------------------\n");
+	}
+	for (j=0;j<NUM_COUNTERS;j++) {
+		if (sum[j] == 0) {
+			continue;
+		}
+		if (options.machine_readable) {
+			printf(":Counter:%s:%llu:\n", counter_names[j],
+				(unsigned long long)sum[j]);
+		} else {
+			printf(" %-24s %13llu\n", counter_names[j],
+				(unsigned long long)sum[j]);
+		}
+	}
+	/* how much of what was read came from memory rather than disk */
+	if (sum[COUNTER_CACHE_PAGES_SAMPLED] != 0) {
+		double ratio = 100.0 * sum[COUNTER_CACHE_PAGES_RESIDENT] /
+			sum[COUNTER_CACHE_PAGES_SAMPLED];
+
+		if (options.machine_readable) {
+			printf(":Counter:Page cache hit ratio:%.1f:\n", ratio);
+		} else {
+			printf(" %-24s %12.1f%%\n", "Page cache hit ratio", ratio);
+		}
+	}
+	if (!options.machine_readable) {
+		printf("\n");
+	}
+}
+
+/* the syncs of each fsync policy. Like the loadfiles, the policies are
+   assigned to the client processes in turn */
+static void report_fsync(void)
+{
+	extern struct nb_operations fileio_ops;
+	struct timespec tnow = timespec_current();
+	struct timespec *tend = tv_end.tv_sec ? &tv_end : &tnow;
+	double runtime = timespec_elapsed2(&tv_start, tend);
+	const char *p;
+	int i, e, num_policies = 1;
+
+	if (options.fsync_policy == NULL) {
+		return;
+	}
+	for (p = options.fsync_policy; (p = strchr(p, ',')); p++) {
+		num_policies++;
+	}
+
+	if (!options.machine_readable) {
+		printf(" Fsync policy               Clients     Syncs    AvgLat    MaxLat    MB/sec\n");
+		printf(" --------------------------------------------------------------------------\n");
+	}
+	for (e = 0; e < num_policies; e++) {
+		char *policy = get_next_arg(options.fsync_policy, e);
+		unsigned count = 0;
+		double total = 0, max = 0, bytes = 0;
+		int nclients = 0;
+
+		for (i=0;i<options.nprocs * options.clients_per_process;i++) {
+			/* only fileio has the policies, other backends of a
+			   mixed run would dilute the numbers */
+			if ((i / options.clients_per_process) % num_policies != e ||
+			    children[i].backend != &fileio_ops) {
+				continue;
+			}
+			count += children[i].fsyncs.count;
+			total += children[i].fsyncs.total_time;
+			max = MAX(max, children[i].fsyncs.max_time);
+			bytes += children[i].bytes - children[i].bytes_done_warmup;
+			nclients++;
+		}
+		if (nclients == 0) {
+			free(policy);
+			continue;
+		}
+		if (options.machine_readable) {
+			printf(":Fsync:%s:%d:%u:%.03f:%.03f:%.2f:\n", policy,
+				nclients, count, count ? 1000*total/count : 0,
+				1000*max, runtime > 0 ? 1.0e-6 * bytes / runtime : 0);
+		} else {
+			printf(" %-24s %9d %9u %9.03f %9.03f %9.2f\n", policy,
+				nclients, count, count ? 1000*total/count : 0,
+				1000*max, runtime > 0 ? 1.0e-6 * bytes / runtime : 0);
+		}
+		free(policy);
+	}
+	if (!options.machine_readable) {
+		printf("\n");
+	}
+}
+
+/* in mixed backend runs, the clients and throughput of one backend */
+static void show_backend(struct nb_operations *backend)
+{
+	struct timespec tnow = timespec_current();
+	struct timespec *tend = tv_end.tv_sec ? &tv_end : &tnow;
+	double runtime = timespec_elapsed2(&tv_start, tend);
+	double bytes = 0;
+	int i, nclients = 0;
+
+	for (i=0;i<options.nprocs * options.clients_per_process;i++) {
+		if (children[i].backend == backend) {
+			bytes += children[i].bytes - children[i].bytes_done_warmup;
+			nclients++;
+		}
+	}
+	if (options.machine_readable) {
+		printf(":Backend:%s:%d:%.2f:\n", backend->backend_name, nclients,
+			runtime > 0 ? 1.0e-6 * bytes / runtime : 0);
+	} else {
+		printf(" Backend %s: %d clients, %.2f MB/sec\n", backend->backend_name,
+			nclients, runtime > 0 ? 1.0e-6 * bytes / runtime : 0);
+	}
+}
+
+static void report_latencies(void)
+{
+	static struct op sum[MAX_BACKENDS][MAX_OPS];
+	struct child_struct *child;
+	int i, b;
+
+	/* the partial interval between the last tick and the end of the
+	   run, which sig_alarm() does not sample */
+	if (options.heatmap) {
+		struct timespec tnow = timespec_current();
+
+		heatmap_sample(children, options.nprocs * options.clients_per_process,
+			       timespec_elapsed2(&tv_start, tv_end.tv_sec ? &tv_end : &tnow));
+	}
+
+	for (b=0;b<num_backends;b++) {
+		sum_ops(backends[b], sum[b]);
+		if (num_backends > 1) {
+			show_backend(backends[b]);
+		}
+		show_one_latency(backends[b], sum[b], sum[b]);
+	}
+	report_pacing();
+	report_counters();
+	report_fsync();
+	report_cleanup();
+	for (b=0;b<num_backends;b++) {
+		if (options.perf_counters) {
+			report_perf(backends[b], sum[b]);
+		}
+		if (options.cpu_stats) {
+			report_cpu(backends[b], sum[b]);
+		}
+	}
+	if (options.calibrate) {
+		report_harness();
+	}
+	if (options.fairness) {
+		report_fairness();
+	}
 
 	if (!options.per_client_results) {
 		return;
@@ -232,19 +834,82 @@ static void report_latencies(void)
 	printf("Per client results:\n");
 	for (i=0;i<options.nprocs * options.clients_per_process;i++) {
 		child = &children[i];
+		for (b=0;backends[b] != child->backend;b++)
+			;
 		printf("Client %u did %u lines and %.0f bytes\n",
 			i, child->line, child->bytes - child->bytes_done_warmup);
-		show_one_latency(child->ops, sum);
+		show_one_latency(child->backend, child->ops, sum[b]);
 	}
 }
 
+/* measure what it costs to timestamp an operation */
+static void calibrate_clock(void)
+{
+	struct timespec res;
+	uint64_t start, t = 0;
+	int i, loops = 1000000;
+
+	clock_getres(OP_CLOCK, &res);
+
+	start = nsec_current();
+	for (i = 0; i < loops; i++) {
+		t += nsec_current();
+	}
+	(void)t;
+
+	printf("Timer %s: resolution %ld ns, %.1f ns per read\n",
+		OP_CLOCK_NAME, res.tv_sec * 1000000000L + res.tv_nsec,
+		(nsec_current() - start) / (double)loops);
+}
+
+/* look up a backend by name, returns NULL if it is unknown */
+static struct nb_operations *find_backend(const char *name)
+{
+	if (strcmp(name, "fileio") == 0) {
+		extern struct nb_operations fileio_ops;
+		return &fileio_ops;
+	} else if (strcmp(name, "sockio") == 0) {
+		extern struct nb_operations sockio_ops;
+		return &sockio_ops;
+	} else if (strcmp(name, "block") == 0) {
+		extern struct nb_operations block_ops;
+		return &block_ops;
+	} else if (strcmp(name, "null") == 0) {
+		extern struct nb_operations null_ops;
+		return &null_ops;
+#ifdef HAVE_LIBNFS
+	} else if (strcmp(name, "nfs") == 0) {
+		extern struct nb_operations nfs_ops;
+		return &nfs_ops;
+#endif
+#ifdef HAVE_LINUX_SCSI_SG
+	} else if (strcmp(name, "scsi") == 0) {
+		extern struct nb_operations scsi_ops;
+		return &scsi_ops;
+#endif /* HAVE_LINUX_SCSI_SG */
+#ifdef HAVE_LIBISCSI
+	} else if (strcmp(name, "iscsi") == 0) {
+		extern struct nb_operations iscsi_ops;
+		return &iscsi_ops;
+#endif
+#ifdef HAVE_LIBSMBCLIENT
+	} else if (strcmp(name, "smb") == 0) {
+		extern struct nb_operations smb_ops;
+		return &smb_ops;
+#endif
+	}
+	return NULL;
+}
+
 /* this creates the specified number of child processes and runs fn()
    in all of them */
 static void create_procs(int nprocs, void (*fn)(struct child_struct *, const char *))
 {
 	int nclients = nprocs * options.clients_per_process;
 	int i;
+	struct barrier *barriers;
 	pid_t *child_pids;
+	char *name;
 
 	for (i = 0; i < nclients; i++) {
 		if (!check_loadfile(get_next_arg(options.loadfile, i))) {
@@ -267,14 +932,25 @@ static void create_procs(int nprocs, void (*fn)(struct child_struct *, const cha
 
 	memset(children, 0, sizeof(*children)*nclients);
 
+	barriers = shm_setup(sizeof(struct barrier)*MAX_BARRIERS);
+	if (!barriers) {
+		printf("Failed to setup shared memory\n");
+		return;
+	}
+	memset(barriers, 0, sizeof(*barriers)*MAX_BARRIERS);
+
 	for (i = 0; i < nclients; i++) {
 		children[i].id = i;
 		children[i].num_clients = nclients;
 		children[i].cleanup = 0;
 		children[i].directory = options.directory;
-		children[i].starttime = timeval_current();
-		children[i].lasttime = timeval_current();
+		children[i].starttime = timespec_current();
+		children[i].lasttime = nsec_current();
 		children[i].all_children = children;
+		children[i].barriers = barriers;
+		name = get_next_arg(options.backend, i / options.clients_per_process);
+		children[i].backend = find_backend(name);
+		free(name);
 	}
 
 	child_pids = malloc(sizeof(pid_t) * nprocs);
@@ -288,6 +964,15 @@ static void create_procs(int nprocs, void (*fn)(struct child_struct *, const cha
 			setlinebuf(stdout);
 			srandom(getpid() ^ time(NULL));
 
+			for (j=0;j<options.clients_per_process;j++) {
+				children[i*options.clients_per_process + j].pid = getpid();
+			}
+			nb_ops = children[i*options.clients_per_process].backend;
+
+			if (options.perf_counters && perf_setup() != 0) {
+				_exit(1);
+			}
+
 			for (j=0;j<options.clients_per_process;j++) {
 				nb_ops->setup(&children[i*options.clients_per_process + j]);
 			}
@@ -323,7 +1008,11 @@ static void create_procs(int nprocs, void (*fn)(struct child_struct *, const cha
 		kill(child_pids[i], SIGCONT);
 	}
 
-	tv_start = timeval_current();
+	tv_start = timespec_current();
+
+	if (options.sys_stats) {
+		sys_stats_report();
+	}
 
 	signal(SIGALRM, sig_alarm);
 	alarm(PRINT_FREQ);
@@ -348,6 +1037,10 @@ static void create_procs(int nprocs, void (*fn)(struct child_struct *, const cha
 	printf("\n");
 
 	report_latencies();
+
+	if (options.heatmap) {
+		heatmap_write(options.heatmap, options.heatmap_format);
+	}
 }
 
 static int parse_opt(int key, char *arg, struct argp_state *state)
@@ -448,6 +1141,92 @@ static int parse_opt(int key, char *arg, struct argp_state *state)
 	case -21:
 		options.block = arg;
 		break;
+	case -22:
+		options.pacing_spin = atoi(arg);
+		break;
+	case -23:
+		options.calibrate = 1;
+		break;
+	case -24:
+		options.cpu_stats = 1;
+		break;
+	case -25:
+		options.perf_counters = 1;
+		break;
+	case -26:
+		options.sys_stats = 1;
+		break;
+	case -27:
+		options.stall_threshold = atof(arg);
+		break;
+	case -28:
+		options.stall_log = arg;
+		break;
+	case -29:
+		options.fairness = 1;
+		break;
+	case -30:
+		options.metrics = arg;
+		break;
+	case -31:
+		options.trace = arg;
+		break;
+	case -32:
+		options.heatmap = arg;
+		break;
+	case -33:
+		options.heatmap_format = arg;
+		break;
+	case -34:
+		options.replay_speed = atof(arg);
+		if (options.replay_speed <= 0) {
+			printf("The replay speed must be greater than 0\n");
+			exit(1);
+		}
+		break;
+	case -35:
+		options.compress_idle = atof(arg);
+		break;
+	case -36:
+		options.shared_prefix = arg;
+		break;
+	case -37:
+		options.hugepages = 1;
+		break;
+	case -38:
+		options.direct = 1;
+		break;
+	case -39:
+		options.name_cache = arg;
+		if (strcmp(arg, "client") != 0 && strcmp(arg, "shared") != 0) {
+			printf("The name cache must be client or shared\n");
+			exit(1);
+		}
+		break;
+	case -40:
+		options.dirfd = 1;
+		break;
+	case -41:
+		options.fsync_policy = arg;
+		break;
+	case -42:
+		options.access_hints = 1;
+		break;
+	case -43:
+		options.mmap = 1;
+		break;
+	case -44:
+		options.drop_on_close = 1;
+		break;
+	case -45:
+		options.drop_between_loads = 1;
+		break;
+	case -46:
+		options.cache_sample = atoi(arg);
+		break;
+	case -47:
+		options.cleanup_workers = atoi(arg);
+		break;
 	case ARGP_KEY_NO_ARGS:
 		printf("You need to specify NPROCS\n");
 		argp_usage(state);
@@ -473,7 +1252,7 @@ static void process_opts(int argc, char **argv)
 {
 	struct argp_option options[] =
 	{
-		{"backend", 'B', "STRING", 0, "dbench backend (fileio, sockio, nfs, scsi, iscsi, smb)", 0},
+		{"backend", 'B', "STRING", 0, "dbench backend (fileio, sockio, nfs, scsi, iscsi, smb, block, null)", 0},
 		{"timelimit", 't', "INTEGER", 0, "timelimit", 0},
 		{"loadfile", 'c', "FILENAME", 0, "loadfile", 0},
 		{"directory", 'D', "STRING", 0, "working directory", 0},
@@ -508,6 +1287,32 @@ static void process_opts(int argc, char **argv)
 		{"smb-user", -20, "STRING", 0, "User to authenticate as : [<domain>/]<user>%<password>", 2},
 #endif
 		{"block", -21, "STRING", 0, "Block device", 2},
+		{"pacing-spin", -22, "INTEGER", 0, "busy-wait the last INTEGER usec before each paced operation", 2},
+		{"calibrate", -23, 0, 0, "measure the timer and report time spent in dbench vs the backend", 3},
+		{"cpu-stats", -24, 0, 0, "report client CPU time and context switches per operation", 3},
+		{"perf-counters", -25, 0, 0, "report cycles, instructions, cache misses and page faults per operation", 3},
+		{"sys-stats", -26, 0, 0, "print disk, writeback, io pressure and network stats every interval", 3},
+		{"stall-threshold", -27, "DOUBLE", 0, "log clients stuck in one operation for longer than DOUBLE seconds", 2},
+		{"stall-log", -28, "FILENAME", 0, "file to write stall reports to", 2},
+		{"fairness", -29, 0, 0, "summarise throughput and latency fairness across clients", 3},
+		{"metrics", -30, "STRING", 0, "serve live metrics on a local port or unix:PATH", 3},
+		{"trace", -31, "FILENAME", 0, "record every operation to a binary trace file", 3},
+		{"heatmap", -32, "FILENAME", 0, "write a latency heatmap per operation", 3},
+		{"heatmap-format", -33, "STRING", 0, "heatmap format: text, svg or json", 3},
+		{"replay-speed", -34, "DOUBLE", 0, "replay timestamped loadfiles DOUBLE times faster", 2},
+		{"compress-idle", -35, "DOUBLE", 0, "shorten idle gaps in timestamped loadfiles to DOUBLE seconds", 2},
+		{"shared-prefix", -36, "STRING", 0, "comma separated loadfile path prefixes shared by all clients", 2},
+		{"hugepages", -37, 0, 0, "back the fileio read and write buffers with huge pages", 3},
+		{"direct", -38, 0, 0, "open files with O_DIRECT in the fileio backend", 3},
+		{"name-cache", -39, "STRING", 0, "cache case insensitive name lookups per client, or shared by the clients of one process (see --clients-per-process)", 3},
+		{"dirfd", -40, 0, 0, "use cached directory fds and *at() calls in the fileio backend", 3},
+		{"fsync-policy", -41, "STRING", 0, "when and how fileio syncs written data: write, bytes:N, ms:N or close, with /fsync, /fdatasync, /sync_file_range or /syncfs", 2},
+		{"access-hints", -42, 0, 0, "pass the sequential and random access hints of NTCreateX to posix_fadvise", 3},
+		{"mmap", -43, 0, 0, "read and write through mmap'd windows of the files in the fileio backend", 3},
+		{"drop-on-close", -44, 0, 0, "drop the pages of a file from the page cache when fileio closes it", 3},
+		{"drop-between-loads", -45, 0, 0, "drop the files of each client from the page cache every time the loadfile restarts", 3},
+		{"cache-sample", -46, "INTEGER", 0, "check which pages of every Nth ReadX are in the page cache with mincore", 3},
+		{"cleanup-workers", -47, "INTEGER", 0, "number of processes each client removes its files with in the fileio backend", 3},
 		{ 0 }
 	};
 
@@ -527,6 +1332,7 @@ static void process_opts(int argc, char **argv)
 
 
 
+
  int main(int argc, char *argv[])
 {
 	double total_bytes = 0;
@@ -552,51 +1358,82 @@ static void process_opts(int argc, char **argv)
 		exit(10);
 	}
 
-	if (strcmp(options.backend, "fileio") == 0) {
-		extern struct nb_operations fileio_ops;
-		nb_ops = &fileio_ops;
-	} else if (strcmp(options.backend, "sockio") == 0) {
-		extern struct nb_operations sockio_ops;
-		nb_ops = &sockio_ops;
-	} else if (strcmp(options.backend, "block") == 0) {
-		extern struct nb_operations block_ops;
-		nb_ops = &block_ops;
-#ifdef HAVE_LIBNFS
-	} else if (strcmp(options.backend, "nfs") == 0) {
-		extern struct nb_operations nfs_ops;
-		nb_ops = &nfs_ops;
-#endif
-#ifdef HAVE_LINUX_SCSI_SG
-	} else if (strcmp(options.backend, "scsi") == 0) {
-		extern struct nb_operations scsi_ops;
-		nb_ops = &scsi_ops;
-#endif /* HAVE_LINUX_SCSI_SG */
-#ifdef HAVE_LIBISCSI
-	} else if (strcmp(options.backend, "iscsi") == 0) {
-		extern struct nb_operations iscsi_ops;
-		nb_ops = &iscsi_ops;
-#endif
-#ifdef HAVE_LIBSMBCLIENT
-	} else if (strcmp(options.backend, "smb") == 0) {
-		extern struct nb_operations smb_ops;
-		nb_ops = &smb_ops;
-#endif
-	} else {
-		printf("Unknown backend '%s'\n", options.backend);
-		exit(1);
+	/* -B may list a backend per client process, like the loadfile */
+	for (i = 0; i < options.nprocs; i++) {
+		char *name = get_next_arg(options.backend, i);
+		struct nb_operations *backend = find_backend(name);
+		int j;
+
+		if (backend == NULL) {
+			printf("Unknown backend '%s'\n", name);
+			exit(1);
+		}
+		free(name);
+		for (j = 0; j < num_backends; j++) {
+			if (backends[j] == backend) {
+				break;
+			}
+		}
+		if (j == num_backends) {
+			if (num_backends == MAX_BACKENDS) {
+				printf("Too many backends, %d is maximum\n", MAX_BACKENDS);
+				exit(1);
+			}
+			backends[num_backends++] = backend;
+		}
 	}
+	nb_ops = backends[0];
 
 	if (options.warmup == -1) {
 		options.warmup = options.timelimit / 5;
 	}
 
-	if (nb_ops->init) {
-		if (nb_ops->init() != 0) {
+	if (options.mmap && options.direct) {
+		printf("--mmap and --direct can not be combined\n");
+		exit(1);
+	}
+
+	/* -F is the policy of syncing after every write */
+	if (options.do_fsync && options.fsync_policy == NULL) {
+		options.fsync_policy = "write";
+	}
+	for (i = 0; options.fsync_policy && i < options.nprocs; i++) {
+		char *policy = get_next_arg(options.fsync_policy, i);
+		struct fsync_policy p;
+
+		if (fsync_policy_parse(policy, &p) != 0) {
+			printf("Invalid fsync policy '%s'\n", policy);
+			exit(1);
+		}
+		free(policy);
+	}
+
+	for (i = 0; i < num_backends; i++) {
+		if (backends[i]->init && backends[i]->init() != 0) {
 			printf("Failed to initialize dbench\n");
 			exit(10);
 		}
 	}
 
+	if (options.calibrate) {
+		calibrate_clock();
+	}
+
+	if (options.metrics && metrics_listen(options.metrics) != 0) {
+		exit(1);
+	}
+
+	if (options.trace && trace_open(options.trace) != 0) {
+		exit(1);
+	}
+
+	if (strcmp(options.heatmap_format, "text") != 0 &&
+	    strcmp(options.heatmap_format, "svg") != 0 &&
+	    strcmp(options.heatmap_format, "json") != 0) {
+		printf("Unknown heatmap format %s\n", options.heatmap_format);
+		exit(1);
+	}
+
 	printf("Running for %d seconds with load '%s' and minimum warmup %d secs\n",
 		options.timelimit, options.loadfile, options.warmup);
 
@@ -30,6 +30,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <fcntl.h>
@@ -92,16 +93,144 @@
 #define True 1
 #define False 0
 
+#ifdef CLOCK_MONOTONIC_RAW
+#define OP_CLOCK CLOCK_MONOTONIC_RAW
+#define OP_CLOCK_NAME "CLOCK_MONOTONIC_RAW"
+#else
+#define OP_CLOCK CLOCK_MONOTONIC
+#define OP_CLOCK_NAME "CLOCK_MONOTONIC"
+#endif
+
+/* hardware counters sampled around each operation with --perf-counters */
+enum perf_counter {
+	PERF_CTR_CYCLES,
+	PERF_CTR_INSTRUCTIONS,
+	PERF_CTR_CACHE_MISSES,
+	PERF_CTR_PAGE_FAULTS,
+	NUM_PERF_COUNTERS
+};
+
+/* latency histogram buckets are powers of two in microseconds, bucket b
+   holds latencies below 2^b usec and the last bucket holds the rest */
+#define LAT_HIST_BUCKETS 32
+
+/* heatmap cells from empty to the largest count */
+#define HEATMAP_SHADES " .:-=+*#%@"
+
+/* --trace file format. The file starts with a trace_header and the names
+   of the operations as TRACE_OPNAME records, followed by chunks that each
+   hold the records of one client. All fields are in host byte order */
+#define TRACE_MAGIC "DBTRACE1"
+#define TRACE_VERSION 1
+
+enum trace_type {
+	TRACE_OP = 1,
+	TRACE_NAME,
+	TRACE_OPNAME
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_ops;
+};
+
+struct trace_chunk {
+	uint32_t client;
+	uint32_t size;
+};
+
+/* one operation. file and status are ids of TRACE_NAME records of the
+   same client, file is 0 if the operation has no file name */
+struct trace_op {
+	uint16_t type;
+	uint16_t op;
+	uint32_t line;
+	uint32_t file;
+	uint32_t status;
+	uint64_t start;
+	uint64_t duration;
+	uint64_t bytes;
+};
+
+/* followed by the name, NUL terminated and padded to TRACE_ALIGN */
+struct trace_name {
+	uint16_t type;
+	uint16_t pad;
+	uint32_t id;
+	uint32_t len;
+	uint32_t pad2;
+};
+
+#define TRACE_ALIGN 8
+
 struct op {
 	unsigned count;
 	double total_time;
 	double max_latency;
+	double user_time;
+	double sys_time;
+	unsigned long vol_cs;
+	unsigned long invol_cs;
+	uint64_t perf[NUM_PERF_COUNTERS];
+	unsigned hist[LAT_HIST_BUCKETS];
+};
+
+/* a BARRIER in the loadfile, shared between the client processes */
+#define MAX_BARRIERS 64
+struct barrier {
+	/* arrivals counted separately for odd and even generations */
+	int arrived[2];
+	int generation;
 };
 
 #define ZERO_STRUCT(x) memset(&(x), 0, sizeof(x))
 
 #define MAX_OPS 100
 
+/* when and how the fileio backend makes written data durable */
+enum fsync_when {
+	FSYNC_WRITE,
+	FSYNC_BYTES,
+	FSYNC_MS,
+	FSYNC_CLOSE
+};
+
+enum fsync_method {
+	FSYNC_FSYNC,
+	FSYNC_FDATASYNC,
+	FSYNC_RANGE,
+	FSYNC_SYNCFS
+};
+
+struct fsync_policy {
+	enum fsync_when when;
+	/* bytes written or milliseconds since the last sync of a file */
+	uint64_t limit;
+	enum fsync_method method;
+};
+
+/* events counted by the backends in child->counters, reported at the
+   end of the run if they happened at all */
+enum counter {
+	COUNTER_DIRECT_IO,
+	COUNTER_DIRECT_UNALIGNED,
+	COUNTER_DIR_SCAN,
+	COUNTER_DIR_SCAN_ENTRIES,
+	COUNTER_NAME_CACHE_HIT,
+	COUNTER_NAME_CACHE_MISS,
+	COUNTER_DIRFD_OPEN,
+	COUNTER_PATH_COMPONENTS_SAVED,
+	COUNTER_HINT_SEQUENTIAL,
+	COUNTER_HINT_RANDOM,
+	COUNTER_MMAP_WINDOW,
+	COUNTER_MMAP_FALLBACK,
+	COUNTER_CACHE_DROP,
+	COUNTER_CACHE_PAGES_SAMPLED,
+	COUNTER_CACHE_PAGES_RESIDENT,
+	NUM_COUNTERS
+};
+
 struct child_struct {
 	int id;
 	int num_clients;
@@ -115,22 +244,61 @@ struct child_struct {
 	double bytes_done_warmup;
 	double max_latency;
 	double worst_latency;
-	struct timeval starttime;
-	struct timeval lasttime;
-	off_t bytes_since_fsync;
+	struct timespec starttime;
+	uint64_t lasttime;
 	char *cname;
 	struct {
 		double last_bytes;
-		struct timeval last_time;
+		struct timespec last_time;
 	} rate;
+	struct {
+		unsigned count;
+		double total_error;
+		double max_error;
+	} pacing;
+	/* loadfile time of the previous operation and the idle time cut
+	   out so far by --compress-idle */
+	struct {
+		double last;
+		double skipped;
+	} replay;
+	struct {
+		uint64_t start;
+		uint64_t end;
+		double sleep_time;
+	} harness;
+	/* when the client removed its files after the run */
+	struct {
+		uint64_t start;
+		uint64_t end;
+	} cleanup_time;
 	struct op ops[MAX_OPS];
+	uint64_t counters[NUM_COUNTERS];
+	/* the syncs made by --fsync-policy */
+	struct {
+		unsigned count;
+		double total_time;
+		double max_time;
+	} fsyncs;
+	struct nb_operations *backend;
 	void *private;
+	void *trace;
 
 	int sequence_point;
 
+	/* the operation in progress, for the stall watchdog */
+	pid_t pid;
+	struct {
+		int in_op;
+		char op[32];
+		char fname[256];
+		uint64_t reported;
+	} current;
+
 	/* Some functions need to be able to access arbitrary child
 	 * structures from each child. */
 	struct child_struct *all_children;
+	struct barrier *barriers;
 };
 
 struct options {
@@ -140,7 +308,6 @@ struct options {
 	int sync_dirs;
 	int do_fsync;
 	int no_resolve;
-	int fsync_frequency;
 	char *tcp_options;
 	int timelimit;
 	int warmup;
@@ -167,6 +334,32 @@ struct options {
 	const char *smb_share;
 	const char *smb_user;
 	const char *block;
+	int pacing_spin;
+	int calibrate;
+	int cpu_stats;
+	int perf_counters;
+	int sys_stats;
+	double stall_threshold;
+	const char *stall_log;
+	int fairness;
+	const char *metrics;
+	const char *trace;
+	const char *heatmap;
+	const char *heatmap_format;
+	double replay_speed;
+	double compress_idle;
+	const char *shared_prefix;
+	int hugepages;
+	int direct;
+	const char *name_cache;
+	int dirfd;
+	const char *fsync_policy;
+	int access_hints;
+	int mmap;
+	int drop_on_close;
+	int drop_between_loads;
+	int cache_sample;
+	int cleanup_workers;
 };
 
 
@@ -190,9 +383,20 @@ struct nb_operations {
 	int (*init)(void);
 	void (*setup)(struct child_struct *child);
 	void (*cleanup)(struct child_struct *child);
+	/* drop the files of a client from the page cache, optional */
+	void (*drop_cache)(struct child_struct *child);
+	/* called before an op is timed, optional */
+	void (*before_op)(struct dbench_op *op, struct backend_op *bop);
 };
 extern struct nb_operations *nb_ops;
 
+/* the distinct backends of a run, each client process may use its own.
+   nb_ops is the backend of the calling client, or the first one in the
+   parent */
+#define MAX_BACKENDS 8
+extern struct nb_operations *backends[MAX_BACKENDS];
+extern int num_backends;
+
 /* CreateDisposition field. */
 #define FILE_SUPERSEDE 0
 #define FILE_OPEN 1
@@ -221,9 +425,12 @@ extern struct options options;
 extern int global_random;
 #define RWBUFSIZE 16*1024*1024
 extern char rw_buf[];
+/* bumped by WRITEPATTERN whenever the content of rw_buf changes */
+extern int rw_pattern_gen;
 
 void all_string_sub(char *s,const char *pattern,const char *insert);
 void child_run(struct child_struct *child0, const char *loadfile);
+const char *get_shared_prefix(unsigned i);
 void msleep(unsigned int t);
 int next_token(char **ptr,char *buff,char *sep);
 int open_socket_in(int type, int port);
@@ -238,8 +445,43 @@ ssize_t sys_getxattr(const char *path, const char *name, void *value, size_t siz
 struct timeval timeval_current(void);
 double timeval_elapsed(struct timeval *tv);
 double timeval_elapsed2(struct timeval *tv1, struct timeval *tv2);
+uint64_t nsec_current(void);
+double nsec_elapsed(uint64_t t);
+struct timespec timespec_current(void);
+double timespec_elapsed(struct timespec *ts);
+double timespec_elapsed2(struct timespec *ts1, struct timespec *ts2);
+void timespec_add(struct timespec *ts, double t);
+double sleep_until(struct timespec *deadline);
+void futex_wait(int *addr, int val, double timeout);
+void futex_wake(int *addr);
 int write_sock(int s, char *buf, int size);
 char *get_next_arg(const char *args, int id);
+int perf_setup(void);
+void perf_read(uint64_t *counters);
+extern const char *perf_counter_names[NUM_PERF_COUNTERS];
+void sys_stats_report(void);
+int metrics_listen(const char *spec);
+void metrics_serve(struct child_struct *children, int nclients,
+		   const char *phase, int num_active, double throughput);
+int trace_open(const char *fname);
+void trace_setup(struct child_struct *child);
+void trace_op(struct child_struct *child, unsigned op, const char *fname,
+	      const char *status, double bytes, uint64_t end);
+void trace_flush(struct child_struct *child);
+void heatmap_sample(struct child_struct *children, int nclients, double t);
+void heatmap_write(const char *fname, const char *format);
+
+int fsync_policy_parse(const char *s, struct fsync_policy *p);
+
+struct name_cache *name_cache_init(void);
+int name_cache_lookup(struct name_cache *nc, struct child_struct *child,
+		      const char *dname, const char *fname);
+void name_cache_add(struct name_cache *nc, const char *path);
+void name_cache_remove(struct name_cache *nc, const char *path, int is_dir);
+int latency_bucket(double t);
+double latency_bucket_limit(int bucket);
+double latency_percentile(const unsigned *hist, double pct);
+char heatmap_shade(double count, double max);
 
 // copied from postgresql
 #if defined(HAVE_FDATASYNC) && !HAVE_DECL_FDATASYNC
@@ -19,27 +19,603 @@
 */
 
 #include "dbench.h"
+#include <setjmp.h>
 
-#define MAX_FILES 200
+/* initial number of slots of the handle table, always a power of 2 */
+#define FTABLE_INITIAL_SIZE 64
+
+/* smallest I/O buffer, a multiple of the huge page size */
+#define IO_BUF_MIN_SIZE (2*1024*1024)
+
+/* size and alignment of the file windows mapped with --mmap */
+#define MMAP_WINDOW (16*1024*1024)
+
+/* buckets and soft limit of the directory fds cached with --dirfd */
+#define DIRFD_HASH 256
+#define DIRFD_MAX 1024
+
+/* offset and size alignment of O_DIRECT I/O. The logical block size is
+   often smaller, but 4k works on every device */
+#define DIRECT_ALIGN 4096
+
+/* getdents64 buffer of the cleanup, a few thousand entries per call */
+#define DELTREE_BUF_SIZE (256*1024)
 
 struct ftable {
+	/* NULL for a free slot */
 	char *name;
 	int fd;
 	int handle;
+	/* opened on a path shared with other clients, fd is -1 if another
+	   client removed the file before we could open it */
+	int shared;
+	/* opened with O_DIRECT */
+	int direct;
+	/* bytes written since the last sync, and when the first of them
+	   was written */
+	off_t dirty;
+	uint64_t dirty_since;
+	/* the window mapped with --mmap, and the file size as far as
+	   this client knows */
+	char *map;
+	off_t map_off;
+	size_t map_len;
+	off_t size;
+	int nomap;
+};
+
+/* the open files of a client, in a hash table keyed by handle with
+   linear probing. It is kept at most half full so that lookups stay
+   constant time, and grows as a loadfile keeps more files open */
+struct fio_client {
+	struct ftable *files;
+	unsigned size;
+	unsigned num_files;
+
+	/* page aligned read and write buffers, grown to the largest I/O.
+	   The write buffer holds rw_buf as of WRITEPATTERN generation
+	   wbuf_gen */
+	char *rbuf, *wbuf;
+	size_t rbuf_size, wbuf_size;
+	int wbuf_gen;
+
+	/* case insensitive lookups, NULL without --name-cache */
+	struct name_cache *names;
+
+	/* open directories for the *at() calls of --dirfd */
+	struct dir_fd *dirs[DIRFD_HASH];
+	unsigned num_dirs;
+
+	/* the --fsync-policy of the client process */
+	int fsync_enabled;
+	struct fsync_policy fsync;
+
+	/* ReadX calls, for --cache-sample */
+	unsigned reads;
 };
 
-static int find_handle(struct child_struct *child, int handle)
+struct dir_fd {
+	struct dir_fd *next;
+	uint32_t hash;
+	int fd;
+	/* the path components the kernel does not walk again when a
+	   name is looked up relative to fd */
+	unsigned components;
+	char path[1];
+};
+
+static unsigned handle_slot(struct fio_client *fc, int handle)
+{
+	return ((uint32_t)handle * 2654435761U) & (fc->size - 1);
+}
+
+/* the slot holding a handle, or the free slot where it belongs */
+static struct ftable *ftable_lookup(struct fio_client *fc, int handle)
+{
+	unsigned i = handle_slot(fc, handle);
+
+	while (fc->files[i].name && fc->files[i].handle != handle) {
+		i = (i + 1) & (fc->size - 1);
+	}
+	return &fc->files[i];
+}
+
+static void ftable_grow(struct fio_client *fc)
+{
+	struct ftable *old = fc->files;
+	unsigned i, old_size = fc->size;
+
+	fc->size = old_size ? old_size * 2 : FTABLE_INITIAL_SIZE;
+	fc->files = calloc(fc->size, sizeof(struct ftable));
+	if (fc->files == NULL) {
+		printf("failed to allocate file table of %u entries\n", fc->size);
+		exit(1);
+	}
+	for (i = 0; i < old_size; i++) {
+		if (old[i].name) {
+			*ftable_lookup(fc, old[i].handle) = old[i];
+		}
+	}
+	free(old);
+}
+
+/* a slot for a newly opened handle. A handle that was never closed is
+   replaced, like a server would reuse the file id */
+static struct ftable *ftable_add(struct fio_client *fc, int handle)
+{
+	struct ftable *f;
+
+	if ((fc->num_files + 1) * 2 > fc->size) {
+		ftable_grow(fc);
+	}
+	f = ftable_lookup(fc, handle);
+	if (f->name) {
+		if (f->map) munmap(f->map, f->map_len);
+		if (f->fd != -1) close(f->fd);
+		free(f->name);
+	} else {
+		fc->num_files++;
+	}
+	f->handle = handle;
+	return f;
+}
+
+/* free a slot, moving back the entries of the probe sequence after it
+   so that no lookup stops early at the hole */
+static void ftable_remove(struct fio_client *fc, struct ftable *f)
+{
+	unsigned mask = fc->size - 1;
+	unsigned i = f - fc->files, j = i, k;
+
+	free(f->name);
+	f->name = NULL;
+	fc->num_files--;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if (fc->files[j].name == NULL) {
+			break;
+		}
+		k = handle_slot(fc, fc->files[j].handle);
+		/* entry j may only move back if its home slot k is not
+		   cyclically within (i, j] */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+			continue;
+		}
+		fc->files[i] = fc->files[j];
+		fc->files[j].name = NULL;
+		i = j;
+	}
+}
+
+/* allocate an I/O buffer of at least size bytes, rounding up so that
+   growing to the largest I/O of a loadfile only takes a few steps */
+static char *io_buf_alloc(size_t *size)
+{
+	static int hugepages_failed;
+	size_t n = IO_BUF_MIN_SIZE;
+	void *buf = MAP_FAILED;
+
+	while (n < *size) {
+		n *= 2;
+	}
+	*size = n;
+
+#ifdef MAP_HUGETLB
+	if (options.hugepages && !hugepages_failed) {
+		buf = mmap(NULL, n, PROT_READ|PROT_WRITE,
+			   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (buf == MAP_FAILED) {
+			printf("failed to allocate huge pages (%s), using normal pages\n",
+			       strerror(errno));
+			hugepages_failed = 1;
+		}
+	}
+#endif
+	if (buf == MAP_FAILED) {
+		buf = mmap(NULL, n, PROT_READ|PROT_WRITE,
+			   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	}
+	if (buf == MAP_FAILED) {
+		printf("failed to allocate I/O buffer of %lu bytes: %s\n",
+		       (unsigned long)n, strerror(errno));
+		exit(1);
+	}
+	return buf;
+}
+
+static char *read_buf(struct child_struct *child, size_t size)
+{
+	struct fio_client *fc = child->private;
+
+	if (size > fc->rbuf_size) {
+		if (fc->rbuf) munmap(fc->rbuf, fc->rbuf_size);
+		fc->rbuf_size = size;
+		fc->rbuf = io_buf_alloc(&fc->rbuf_size);
+	}
+	return fc->rbuf;
+}
+
+/* the write buffer filled with the current write pattern, which is only
+   copied again after WRITEPATTERN or when the buffer grows */
+static char *write_buf(struct child_struct *child, size_t size)
+{
+	struct fio_client *fc = child->private;
+	size_t i;
+
+	if (size > fc->wbuf_size) {
+		if (fc->wbuf) munmap(fc->wbuf, fc->wbuf_size);
+		fc->wbuf_size = size;
+		fc->wbuf = io_buf_alloc(&fc->wbuf_size);
+		fc->wbuf_gen = -1;
+	}
+	if (fc->wbuf_gen != rw_pattern_gen) {
+		for (i = 0; i < fc->wbuf_size; i += RWBUFSIZE) {
+			memcpy(fc->wbuf + i, rw_buf, MIN(fc->wbuf_size - i, RWBUFSIZE));
+		}
+		fc->wbuf_gen = rw_pattern_gen;
+	}
+	return fc->wbuf;
+}
+
+/* read or write through O_DIRECT. I/Os that are not aligned to
+   DIRECT_ALIGN are rounded out to whole blocks in the read buffer.
+   Writes read the partial blocks at either end first and restore the
+   file size afterwards, so the file ends up as with buffered I/O */
+static ssize_t direct_pread(struct child_struct *child, int fd,
+			    size_t size, off_t offset)
+{
+	off_t start = offset & ~(off_t)(DIRECT_ALIGN - 1);
+	off_t end = (offset + size + DIRECT_ALIGN - 1) & ~(off_t)(DIRECT_ALIGN - 1);
+	ssize_t ret;
+
+	child->counters[COUNTER_DIRECT_IO]++;
+	if (start == offset && end == (off_t)(offset + size)) {
+		return pread(fd, read_buf(child, size), size, offset);
+	}
+
+	child->counters[COUNTER_DIRECT_UNALIGNED]++;
+	ret = pread(fd, read_buf(child, end - start), end - start, start);
+	if (ret == -1) {
+		return -1;
+	}
+	ret -= offset - start;
+	return MAX(0, MIN(ret, (ssize_t)size));
+}
+
+static ssize_t direct_pwrite(struct child_struct *child, int fd,
+			     const char *data, size_t size, off_t offset)
+{
+	off_t start = offset & ~(off_t)(DIRECT_ALIGN - 1);
+	off_t end = (offset + size + DIRECT_ALIGN - 1) & ~(off_t)(DIRECT_ALIGN - 1);
+	off_t new_size;
+	struct stat st;
+	char *buf;
+	ssize_t ret;
+
+	child->counters[COUNTER_DIRECT_IO]++;
+	if (start == offset && end == (off_t)(offset + size)) {
+		return pwrite(fd, data, size, offset);
+	}
+
+	child->counters[COUNTER_DIRECT_UNALIGNED]++;
+	if (fstat(fd, &st) != 0) {
+		return -1;
+	}
+	buf = read_buf(child, end - start);
+	memset(buf, 0, DIRECT_ALIGN);
+	memset(buf + (end - start) - DIRECT_ALIGN, 0, DIRECT_ALIGN);
+	if (start < offset && pread(fd, buf, DIRECT_ALIGN, start) == -1) {
+		return -1;
+	}
+	if (end > (off_t)(offset + size) &&
+	    pread(fd, buf + (end - start) - DIRECT_ALIGN, DIRECT_ALIGN,
+		  end - DIRECT_ALIGN) == -1) {
+		return -1;
+	}
+	memcpy(buf + (offset - start), data, size);
+
+	ret = pwrite(fd, buf, end - start, start);
+	if (ret != end - start) {
+		return ret == -1 ? -1 : MAX(0, MIN(ret - (offset - start), (ssize_t)size));
+	}
+	new_size = MAX(st.st_size, (off_t)(offset + size));
+	if (end > new_size && ftruncate(fd, new_size) != 0) {
+		return -1;
+	}
+	return size;
+}
+
+/* with --mmap, copies to and from a window are done between
+   sigsetjmp() and this flag, so that a SIGBUS from a file that was
+   truncated behind our back turns into a fallback to pread/pwrite */
+static sigjmp_buf mmap_jmp;
+static volatile sig_atomic_t in_mmap_copy;
+
+static void mmap_sigbus(int sig)
+{
+	if (!in_mmap_copy) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+		return;
+	}
+	siglongjmp(mmap_jmp, 1);
+}
+
+static int mmap_copy(void *dst, const void *src, size_t len)
+{
+	if (sigsetjmp(mmap_jmp, 1)) {
+		in_mmap_copy = 0;
+		return -1;
+	}
+	in_mmap_copy = 1;
+	memcpy(dst, src, len);
+	in_mmap_copy = 0;
+	return 0;
+}
+
+/* the address of offset in the window of a file, mapping a new window
+   if the I/O does not fit the current one. NULL if the file can not be
+   mapped */
+static char *mmap_window(struct child_struct *child, struct ftable *f,
+			 off_t offset, size_t len)
+{
+	off_t start;
+	size_t map_len;
+	void *map;
+
+	if (f->map && offset >= f->map_off &&
+	    offset + len <= f->map_off + f->map_len) {
+		return f->map + (offset - f->map_off);
+	}
+	if (f->map) {
+		munmap(f->map, f->map_len);
+		f->map = NULL;
+	}
+
+	start = offset & ~(off_t)(MMAP_WINDOW - 1);
+	map_len = (offset + len - start + MMAP_WINDOW - 1) & ~(size_t)(MMAP_WINDOW - 1);
+	map = mmap(NULL, map_len, PROT_READ|PROT_WRITE, MAP_SHARED, f->fd, start);
+	if (map == MAP_FAILED) {
+		static int warned;
+		if (!warned) {
+			printf("failed to mmap %s (%s), using read and write\n",
+			       f->name, strerror(errno));
+			warned = 1;
+		}
+		f->nomap = 1;
+		return NULL;
+	}
+	child->counters[COUNTER_MMAP_WINDOW]++;
+	f->map = map;
+	f->map_off = start;
+	f->map_len = map_len;
+	return f->map + (offset - start);
+}
+
+/* an I/O could not go through the window, learn the real file size if
+   it faulted */
+static void mmap_fault(struct child_struct *child, struct ftable *f, char *p)
+{
+	struct stat st;
+
+	child->counters[COUNTER_MMAP_FALLBACK]++;
+	if (p && fstat(f->fd, &st) == 0) {
+		f->size = st.st_size;
+	}
+}
+
+/* the file may have been grown through another handle since f->size was
+   last set, so check with fstat before relying on it */
+static int mmap_refresh_size(struct ftable *f)
+{
+	struct stat st;
+
+	if (fstat(f->fd, &st) != 0) {
+		return -1;
+	}
+	f->size = st.st_size;
+	return 0;
+}
+
+static ssize_t mmap_pread(struct child_struct *child, struct ftable *f,
+			  size_t size, off_t offset)
 {
-	struct ftable *ftable = child->private;
+	size_t len;
+	char *p;
+
+	if (offset + (off_t)size > f->size) {
+		mmap_refresh_size(f);
+	}
+	if (offset >= f->size) {
+		return 0;
+	}
+	len = MIN(size, (size_t)(f->size - offset));
+	p = mmap_window(child, f, offset, len);
+	if (p && mmap_copy(read_buf(child, len), p, len) == 0) {
+		return len;
+	}
+	mmap_fault(child, f, p);
+	return pread(f->fd, read_buf(child, size), size, offset);
+}
+
+static ssize_t mmap_pwrite(struct child_struct *child, struct ftable *f,
+			   const char *buf, size_t size, off_t offset)
+{
+	char *p;
+
+	/* stores past the end of the file would fault. Only ever grow
+	   it, a shorter f->size may be stale */
+	if (offset + (off_t)size > f->size) {
+		if (mmap_refresh_size(f) != 0) {
+			return -1;
+		}
+		if (offset + (off_t)size > f->size) {
+			if (ftruncate(f->fd, offset + size) != 0) {
+				return -1;
+			}
+			f->size = offset + size;
+		}
+	}
+	p = mmap_window(child, f, offset, size);
+	if (p && mmap_copy(p, buf, size) == 0) {
+		return size;
+	}
+	mmap_fault(child, f, p);
+	return pwrite(f->fd, buf, size, offset);
+}
+
+static struct ftable *find_handle(struct child_struct *child, int handle)
+{
+	struct fio_client *fc = child->private;
+	struct ftable *f = ftable_lookup(fc, handle);
+
+	if (f->name == NULL) {
+		printf("(%d) ERROR: handle %d was not found\n", 
+		       child->line, handle);
+		exit(1);
+	}
+	return f;
+}
+
+
+static void dirfd_flush(struct fio_client *fc)
+{
+	struct dir_fd *d;
 	int i;
-	for (i=0;i<MAX_FILES;i++) {
-		if (ftable[i].handle == handle) return i;
+
+	for (i = 0; i < DIRFD_HASH; i++) {
+		while ((d = fc->dirs[i])) {
+			fc->dirs[i] = d->next;
+			close(d->fd);
+			free(d);
+		}
 	}
-	printf("(%d) ERROR: handle %d was not found\n", 
-	       child->line, handle);
-	exit(1);
+	fc->num_dirs = 0;
+}
+
+static int dir_at(struct child_struct *child, const char *path,
+		  const char **name, int may_flush)
+{
+	struct fio_client *fc = child->private;
+	const char *slash = strrchr(path, '/');
+	uint32_t hash = 5381;
+	struct dir_fd *d;
+	size_t i, len;
+	int fd;
+
+	*name = path;
+	if (!options.dirfd || slash == NULL || slash == path || slash[1] == 0) {
+		return AT_FDCWD;
+	}
+	len = slash - path;
+	for (i = 0; i < len; i++) {
+		hash = hash * 33 + (unsigned char)path[i];
+	}
+	for (d = fc->dirs[hash % DIRFD_HASH]; d; d = d->next) {
+		if (d->hash == hash && strncmp(d->path, path, len) == 0 &&
+		    d->path[len] == 0) {
+			child->counters[COUNTER_PATH_COMPONENTS_SAVED] += d->components;
+			*name = slash + 1;
+			return d->fd;
+		}
+	}
+
+	if (may_flush && fc->num_dirs >= DIRFD_MAX) {
+		dirfd_flush(fc);
+	}
+	d = malloc(sizeof(*d) + len);
+	memcpy(d->path, path, len);
+	d->path[len] = 0;
+	fd = open(d->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1) {
+		free(d);
+		return AT_FDCWD;
+	}
+	child->counters[COUNTER_DIRFD_OPEN]++;
+	d->fd = fd;
+	d->hash = hash;
+	d->components = 0;
+	for (i = 0; i < len; i++) {
+		if (path[i] != '/' && (i == 0 || path[i-1] == '/')) {
+			d->components++;
+		}
+	}
+	d->next = fc->dirs[hash % DIRFD_HASH];
+	fc->dirs[hash % DIRFD_HASH] = d;
+	fc->num_dirs++;
+
+	*name = slash + 1;
+	return fd;
 }
 
+/*
+  with --dirfd, split a path into the cached fd of its directory and
+  the name within it, for the *at() calls. Otherwise, or if the
+  directory can not be opened, return AT_FDCWD and the whole path
+*/
+static int path_at(struct child_struct *child, const char *path, const char **name)
+{
+	return dir_at(child, path, name, 1);
+}
+
+/* a directory was removed or renamed, close the fds of it and of the
+   directories below it */
+static void dirfd_forget(struct child_struct *child, const char *path)
+{
+	struct fio_client *fc = child->private;
+	size_t len = strlen(path);
+	struct dir_fd **p, *d;
+	int i;
+
+	if (!options.dirfd) {
+		return;
+	}
+	for (i = 0; i < DIRFD_HASH; i++) {
+		for (p = &fc->dirs[i]; (d = *p); ) {
+			if (strncmp(d->path, path, len) == 0 &&
+			    (d->path[len] == 0 || d->path[len] == '/')) {
+				*p = d->next;
+				close(d->fd);
+				free(d);
+				fc->num_dirs--;
+			} else {
+				p = &d->next;
+			}
+		}
+	}
+}
+
+/* stat() a path, with --dirfd relative to the cached directory and with
+   statx() asking only for the fields that fileio looks at */
+static int path_stat(struct child_struct *child, const char *path, struct stat *st)
+{
+	const char *name;
+	int dfd;
+
+	if (!options.dirfd) {
+		return stat(path, st);
+	}
+	dfd = path_at(child, path, &name);
+#ifdef HAVE_STATX
+	{
+		struct statx stx;
+
+		if (statx(dfd, name, 0, STATX_TYPE|STATX_MODE|STATX_SIZE|
+			  STATX_ATIME|STATX_MTIME, &stx) != 0) {
+			return -1;
+		}
+		memset(st, 0, sizeof(*st));
+		st->st_mode = stx.stx_mode;
+		st->st_size = stx.stx_size;
+		st->st_atime = stx.stx_atime.tv_sec;
+		st->st_mtime = stx.stx_mtime.tv_sec;
+		return 0;
+	}
+#else
+	return fstatat(dfd, name, st, 0);
+#endif
+}
 
 /* Find the directory holding a file, and flush it to disk.  We do
    this in -S mode after a directory-modifying mode, to simulate the
@@ -48,9 +624,23 @@ static int find_handle(struct child_struct *child, int handle)
 static void sync_parent(struct child_struct *child, const char *fname)
 {
 	char *copy_name;
+	const char *name;
 	int dir_fd;
 	char *slash;
 
+	dir_fd = path_at(child, fname, &name);
+	if (dir_fd != AT_FDCWD) {
+#if defined(HAVE_FDATASYNC)
+		if (fdatasync(dir_fd) == -1) {
+#else
+		if (fsync(dir_fd) == -1) {
+#endif
+			printf("[%d] datasync directory of \"%s\" failed: %s\n",
+			       child->line, fname, strerror(errno));
+		}
+		return;
+	}
+
 	if (strchr(fname, '/')) {
 		copy_name = strdup(fname);
 		slash = strrchr(copy_name, '/');
@@ -147,11 +737,21 @@ static int expected_status(const char *status)
 	return -1;
 }
 
+/*
+  "*" accepts any result. It is used for paths shared between clients,
+  where other clients may have created or removed the file already
+*/
+static int any_status(const char *status)
+{
+	return strcmp(status, "*") == 0;
+}
+
 /*
   simulate pvfs_resolve_name()
 */
 static void resolve_name(struct child_struct *child, const char *name)
 {
+	struct fio_client *fc = child->private;
 	struct stat st;
 	char *dname, *fname;
 	DIR *dir;
@@ -160,7 +760,7 @@ static void resolve_name(struct child_struct *child, const char *name)
 
 	if (name == NULL) return;
 
-	if (stat(name, &st) == 0) {
+	if (path_stat(child, name, &st) == 0) {
 		xattr_fname_read_hook(child, name);
 		return;
 	}
@@ -175,18 +775,179 @@ static void resolve_name(struct child_struct *child, const char *name)
 	*p = 0;
 	fname = p+1;
 
+	if (fc->names) {
+		name_cache_lookup(fc->names, child, dname, fname);
+		free(dname);
+		return;
+	}
+
 	dir = opendir(dname);
 	if (!dir) {
 		free(dname);
 		return;
 	}
+	child->counters[COUNTER_DIR_SCAN]++;
 	while ((d = readdir(dir))) {
+		child->counters[COUNTER_DIR_SCAN_ENTRIES]++;
 		if (strcasecmp(fname, d->d_name) == 0) break;
 	}
 	closedir(dir);
 	free(dname);
 }
 
+/* keep the name cache in step with the changes made by the client */
+static void names_add(struct child_struct *child, const char *path)
+{
+	struct fio_client *fc = child->private;
+	if (fc->names) name_cache_add(fc->names, path);
+}
+
+static void names_remove(struct child_struct *child, const char *path, int is_dir)
+{
+	struct fio_client *fc = child->private;
+	if (fc->names) name_cache_remove(fc->names, path, is_dir);
+}
+
+/*
+  parse an fsync policy "<when>[/<method>]". When is write, bytes:N,
+  ms:N or close, the method fsync, fdatasync, sync_file_range or
+  syncfs. Returns 0 on success
+*/
+int fsync_policy_parse(const char *s, struct fsync_policy *p)
+{
+	const char *method = strchr(s, '/');
+	size_t len = method ? (size_t)(method - s) : strlen(s);
+	char *end;
+
+	memset(p, 0, sizeof(*p));
+	if (len == 5 && strncmp(s, "write", 5) == 0) {
+		p->when = FSYNC_WRITE;
+	} else if (len == 5 && strncmp(s, "close", 5) == 0) {
+		p->when = FSYNC_CLOSE;
+	} else if (strncmp(s, "bytes:", 6) == 0 || strncmp(s, "ms:", 3) == 0) {
+		p->when = s[0] == 'b' ? FSYNC_BYTES : FSYNC_MS;
+		p->limit = strtoull(strchr(s, ':') + 1, &end, 0);
+		if (p->when == FSYNC_BYTES) {
+			switch (*end) {
+			case 'g': case 'G': p->limit *= 1024;
+				/* fall through */
+			case 'm': case 'M': p->limit *= 1024;
+				/* fall through */
+			case 'k': case 'K': p->limit *= 1024;
+				end++;
+			}
+		}
+		if (end != s + len || p->limit == 0) {
+			return -1;
+		}
+	} else {
+		return -1;
+	}
+
+	if (method == NULL || strcmp(method + 1, "fsync") == 0) {
+		p->method = FSYNC_FSYNC;
+	} else if (strcmp(method + 1, "fdatasync") == 0) {
+		p->method = FSYNC_FDATASYNC;
+#ifdef HAVE_SYNC_FILE_RANGE
+	} else if (strcmp(method + 1, "sync_file_range") == 0) {
+		p->method = FSYNC_RANGE;
+#endif
+#ifdef HAVE_SYNCFS
+	} else if (strcmp(method + 1, "syncfs") == 0) {
+		p->method = FSYNC_SYNCFS;
+#endif
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/* sync a file the way the fsync policy says, timing the sync */
+static void fsync_file(struct child_struct *child, struct ftable *f)
+{
+	struct fio_client *fc = child->private;
+	uint64_t start = nsec_current();
+	double t;
+	int ret = 0;
+
+	switch (fc->fsync.method) {
+	case FSYNC_FSYNC:
+		ret = fsync(f->fd);
+		break;
+	case FSYNC_FDATASYNC:
+#ifdef HAVE_FDATASYNC
+		ret = fdatasync(f->fd);
+#else
+		ret = fsync(f->fd);
+#endif
+		break;
+	case FSYNC_RANGE:
+#ifdef HAVE_SYNC_FILE_RANGE
+		/* only the data, without the metadata or a disk cache flush */
+		ret = sync_file_range(f->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE|
+				      SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+		break;
+	case FSYNC_SYNCFS:
+#ifdef HAVE_SYNCFS
+		ret = syncfs(f->fd);
+#endif
+		break;
+	}
+	if (ret == -1 && !f->shared) {
+		printf("[%d] sync failed on %s (%s)\n",
+		       child->line, f->name, strerror(errno));
+	}
+
+	t = nsec_elapsed(start);
+	child->fsyncs.count++;
+	child->fsyncs.total_time += t;
+	child->fsyncs.max_time = MAX(child->fsyncs.max_time, t);
+	f->dirty = 0;
+	f->dirty_since = 0;
+}
+
+/* there is no timer, so the ms:N deadline of a file is only checked
+   when it is written or closed */
+static int fsync_overdue(struct fio_client *fc, struct ftable *f)
+{
+	return f->dirty &&
+		nsec_current() - f->dirty_since >= fc->fsync.limit * 1000000;
+}
+
+/* account a write to a file and sync it if the policy says so */
+static void fsync_after_write(struct child_struct *child, struct ftable *f,
+			      int size)
+{
+	struct fio_client *fc = child->private;
+
+	if (f->dirty == 0) {
+		f->dirty_since = nsec_current();
+	}
+	f->dirty += size;
+	if (!fc->fsync_enabled) {
+		return;
+	}
+
+	switch (fc->fsync.when) {
+	case FSYNC_WRITE:
+		fsync_file(child, f);
+		break;
+	case FSYNC_BYTES:
+		if ((uint64_t)f->dirty >= fc->fsync.limit) {
+			fsync_file(child, f);
+		}
+		break;
+	case FSYNC_MS:
+		if (fsync_overdue(fc, f)) {
+			fsync_file(child, f);
+		}
+		break;
+	case FSYNC_CLOSE:
+		break;
+	}
+}
+
 static void failed(struct child_struct *child)
 {
 	child->failed = 1;
@@ -196,69 +957,262 @@ static void failed(struct child_struct *child)
 
 static void fio_setup(struct child_struct *child)
 {
-	struct ftable *ftable;
-	ftable = calloc(MAX_FILES, sizeof(struct ftable));
-	child->private = ftable;
-	child->rate.last_time = timeval_current();
+	struct fio_client *fc;
+	/* process private, so only shared with --clients-per-process > 1 */
+	static struct name_cache *shared_names;
+	fc = calloc(1, sizeof(struct fio_client));
+	ftable_grow(fc);
+	if (options.name_cache && strcmp(options.name_cache, "shared") == 0) {
+		if (shared_names == NULL) shared_names = name_cache_init();
+		fc->names = shared_names;
+	} else if (options.name_cache) {
+		fc->names = name_cache_init();
+	}
+	if (options.fsync_policy) {
+		char *policy = get_next_arg(options.fsync_policy,
+					    child->id / options.clients_per_process);
+		fsync_policy_parse(policy, &fc->fsync);
+		fc->fsync_enabled = 1;
+		free(policy);
+	}
+	child->private = fc;
+	child->rate.last_time = timespec_current();
 	child->rate.last_bytes = 0;
+#ifndef HAVE_O_DIRECT
+	if (options.direct) {
+		printf("O_DIRECT is not supported on this platform\n");
+		exit(1);
+	}
+#endif
+	if (options.mmap) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = mmap_sigbus;
+		sigaction(SIGBUS, &sa, NULL);
+	}
 }
 
 static void fio_unlink(struct dbench_op *op)
 {
+	const char *name;
+	int dfd, ret;
+
 	resolve_name(op->child, op->fname);
 
-	if (unlink(op->fname) != expected_status(op->status)) {
+	dfd = path_at(op->child, op->fname, &name);
+	ret = unlinkat(dfd, name, 0);
+	if (ret != expected_status(op->status) &&
+	    !any_status(op->status)) {
 		printf("[%d] unlink %s failed (%s) - expected %s\n", 
 		       op->child->line, op->fname, strerror(errno), op->status);
 		failed(op->child);
 	}
+	if (ret == 0) names_remove(op->child, op->fname, 0);
 	if (options.sync_dirs) sync_parent(op->child, op->fname);
 }
 
 static void fio_mkdir(struct dbench_op *op)
 {
 	struct stat st;
+	const char *name;
+	int dfd;
 	resolve_name(op->child, op->fname);
-	if (options.stat_check && stat(op->fname, &st) == 0) {
+	if (options.stat_check && path_stat(op->child, op->fname, &st) == 0) {
 		return;
 	}
-	mkdir(op->fname, 0777);
+	dfd = path_at(op->child, op->fname, &name);
+	if (mkdirat(dfd, name, 0777) == 0) {
+		names_add(op->child, op->fname);
+	}
 }
 
 static void fio_rmdir(struct dbench_op *op)
 {
 	struct stat st;
+	const char *name;
+	int dfd, ret;
 	resolve_name(op->child, op->fname);
 
 	if (options.stat_check && 
-	    (stat(op->fname, &st) != 0 || !S_ISDIR(st.st_mode))) {
+	    (path_stat(op->child, op->fname, &st) != 0 || !S_ISDIR(st.st_mode))) {
 		return;
 	}
 
-	if (rmdir(op->fname) != expected_status(op->status)) {
+	dfd = path_at(op->child, op->fname, &name);
+	ret = unlinkat(dfd, name, AT_REMOVEDIR);
+	if (ret != expected_status(op->status) &&
+	    !any_status(op->status)) {
 		printf("[%d] rmdir %s failed (%s) - expected %s\n", 
 		       op->child->line, op->fname, strerror(errno), op->status);
 		failed(op->child);
 	}
+	if (ret == 0) {
+		names_remove(op->child, op->fname, 1);
+		dirfd_forget(op->child, op->fname);
+	}
 	if (options.sync_dirs) sync_parent(op->child, op->fname);
 }
 
+/* pass the access pattern a client announced when opening a file on
+   to the kernel, like smbd does. Sequential doubles the readahead
+   window, random turns readahead off */
+static void access_hints(struct child_struct *child, int fd,
+			 uint32_t create_options)
+{
+#ifdef HAVE_POSIX_FADVISE
+	if (create_options & FILE_SEQUENTIAL_ONLY) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		child->counters[COUNTER_HINT_SEQUENTIAL]++;
+	} else if (create_options & FILE_RANDOM_ACCESS) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+		child->counters[COUNTER_HINT_RANDOM]++;
+	}
+#endif
+}
+
+/* drop the clean pages of a file from the page cache, so the next read
+   of it goes to disk. Dirty pages are not dropped */
+static void drop_cache(struct child_struct *child, int fd)
+{
+#ifdef HAVE_POSIX_FADVISE
+	if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0) {
+		child->counters[COUNTER_CACHE_DROP]++;
+	}
+#endif
+}
+
+/* drop all files of a client from the page cache. The files are
+   written back first, DONTNEED leaves dirty pages in the cache */
+static void drop_tree(struct child_struct *child, const char *dname)
+{
+	DIR *d;
+	struct dirent *de;
+
+	d = opendir(dname);
+	if (d == NULL) return;
+	for (de = readdir(d); de; de = readdir(d)) {
+		struct stat st;
+		char *fname = NULL;
+		int fd;
+
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+		if (asprintf(&fname, "%s/%s", dname, de->d_name) < 0) {
+			exit(1);
+		}
+		if (lstat(fname, &st) != 0) {
+			free(fname);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			drop_tree(child, fname);
+		} else if (S_ISREG(st.st_mode) &&
+			   (fd = open(fname, O_RDONLY)) != -1) {
+#ifdef HAVE_FDATASYNC
+			fdatasync(fd);
+#else
+			fsync(fd);
+#endif
+			drop_cache(child, fd);
+			close(fd);
+		}
+		free(fname);
+	}
+	closedir(d);
+}
+
+static void fio_drop_cache(struct child_struct *child)
+{
+	char *dname;
+
+	if (asprintf(&dname, "%s/clients/client%d", child->directory,
+		     child->id) < 0) {
+		exit(1);
+	}
+	drop_tree(child, dname);
+	free(dname);
+}
+
+/* count the pages of a read that are in the page cache before it is
+   done. mincore needs a mapping of the range, which is not touched, so
+   sampling does not fault any pages in */
+static void cache_sample(struct child_struct *child, struct ftable *f,
+			 size_t size, off_t offset)
+{
+#ifdef HAVE_MINCORE
+	static long page_size;
+	unsigned char *vec;
+	size_t len, pages, i;
+	off_t start, end;
+	struct stat st;
+	void *p;
+
+	if (page_size == 0) page_size = sysconf(_SC_PAGESIZE);
+	if (fstat(f->fd, &st) != 0) return;
+	start = offset & ~(off_t)(page_size - 1);
+	end = MIN(offset + (off_t)size, st.st_size);
+	if (end <= offset) return;
+	len = end - start;
+	pages = (len + page_size - 1) / page_size;
+
+	/* files opened write only can not be mapped */
+	p = mmap(NULL, len, PROT_READ, MAP_SHARED, f->fd, start);
+	if (p == MAP_FAILED) return;
+	vec = malloc(pages);
+	if (vec && mincore(p, len, vec) == 0) {
+		child->counters[COUNTER_CACHE_PAGES_SAMPLED] += pages;
+		for (i = 0; i < pages; i++) {
+			child->counters[COUNTER_CACHE_PAGES_RESIDENT] += vec[i] & 1;
+		}
+	}
+	free(vec);
+	munmap(p, len);
+#endif
+}
+
+static void fio_readx(struct dbench_op *op);
+
+/* called before the op is timed, so the sampling of --cache-sample does
+   not add to the latency of the ReadX it samples */
+static void fio_before_op(struct dbench_op *op, struct backend_op *bop)
+{
+	struct fio_client *fc = op->child->private;
+	struct ftable *f;
+
+	if (bop->fn != fio_readx || options.cache_sample <= 0 ||
+	    options.fake_io) {
+		return;
+	}
+	f = ftable_lookup(fc, op->params[0]);
+	/* O_DIRECT reads bypass the cache */
+	if (f->name == NULL || f->fd == -1 || f->direct) {
+		return;
+	}
+	if (++fc->reads % options.cache_sample == 0) {
+		cache_sample(op->child, f, op->params[2], op->params[1]);
+	}
+}
+
 static void fio_createx(struct dbench_op *op)
 {
 	uint32_t create_options = op->params[0];
 	uint32_t create_disposition = op->params[1];
 	int fnum = op->params[2];
-	int fd, i;
+	int fd, dfd;
 	int flags = O_RDWR;
 	struct stat st;
-	struct ftable *ftable = (struct ftable *)op->child->private;
+	struct ftable *f;
+	const char *name;
 
 	resolve_name(op->child, op->fname);
 
 	if (options.sync_open) flags |= O_SYNC;
 
 	if (create_disposition == FILE_CREATE) {
-		if (options.stat_check && stat(op->fname, &st) == 0) {
+		if (options.stat_check && path_stat(op->child, op->fname, &st) == 0) {
 			create_disposition = FILE_OPEN;
 		} else {
 			flags |= O_CREAT;
@@ -270,49 +1224,75 @@ static void fio_createx(struct dbench_op *op)
 		flags |= O_CREAT | O_TRUNC;
 	}
 
+	dfd = path_at(op->child, op->fname, &name);
+
 	if (create_options & FILE_DIRECTORY_FILE) {
 		/* not strictly correct, but close enough */
-		if (!options.stat_check || stat(op->fname, &st) == -1) {
-			mkdir(op->fname, 0700);
+		if (!options.stat_check || path_stat(op->child, op->fname, &st) == -1) {
+			mkdirat(dfd, name, 0700);
 		}
 	}
 
 	if (create_options & FILE_DIRECTORY_FILE) flags = O_RDONLY|O_DIRECTORY;
+#ifdef HAVE_O_DIRECT
+	if (options.direct && !(flags & O_DIRECTORY)) flags |= O_DIRECT;
+#endif
 
-	fd = open(op->fname, flags, 0600);
+	fd = openat(dfd, name, flags, 0600);
 	if (fd == -1 && errno == EISDIR) {
 		flags = O_RDONLY|O_DIRECTORY;
-		fd = open(op->fname, flags, 0600);
+		fd = openat(dfd, name, flags, 0600);
 	}
-	if (fd == -1) {
+#ifdef HAVE_O_DIRECT
+	if (fd == -1 && errno == EINVAL && (flags & O_DIRECT)) {
+		static int warned;
+		if (!warned) {
+			printf("O_DIRECT is not supported for %s, using buffered I/O\n",
+			       op->fname);
+			warned = 1;
+		}
+		flags &= ~O_DIRECT;
+		fd = openat(dfd, name, flags, 0600);
+	}
+#endif
+	if (fd == -1 && !any_status(op->status)) {
 		if (expected_status(op->status) == 0) {
 			printf("[%d] open %s failed for handle %d (%s)\n", 
 			       op->child->line, op->fname, fnum, strerror(errno));
 		}
 		return;
 	}
-	if (expected_status(op->status) != 0) {
+	if (expected_status(op->status) != 0 && !any_status(op->status)) {
 		printf("[%d] open %s succeeded for handle %d\n", 
 		       op->child->line, op->fname, fnum);
 		close(fd);
 		return;
 	}
 	
-	for (i=0;i<MAX_FILES;i++) {
-		if (ftable[i].handle == 0) break;
-	}
-	if (i == MAX_FILES) {
-		printf("file table full for %s\n", op->fname);
-		exit(1);
+	f = ftable_add(op->child->private, fnum);
+	f->name = strdup(op->fname);
+	f->fd = fd;
+	f->shared = any_status(op->status);
+	f->dirty = 0;
+	f->dirty_since = 0;
+	f->map = NULL;
+	f->nomap = !options.mmap || f->shared;
+	f->size = 0;
+#ifdef HAVE_O_DIRECT
+	f->direct = (flags & O_DIRECT) != 0;
+#endif
+	if (fd == -1) {
+		return;
 	}
-	ftable[i].name = strdup(op->fname);
-	ftable[i].handle = fnum;
-	ftable[i].fd = fd;
+	names_add(op->child, op->fname);
 
 	fstat(fd, &st);
+	f->size = st.st_size;
+	if (S_ISDIR(st.st_mode)) f->nomap = 1;
 
 	if (!S_ISDIR(st.st_mode)) {
 		xattr_fd_write_hook(op->child, fd);
+		if (options.access_hints) access_hints(op->child, fd, create_options);
 	}
 }
 
@@ -322,45 +1302,56 @@ static void fio_writex(struct dbench_op *op)
 	int offset = op->params[1];
 	int size = op->params[2];
 	int ret_size = op->params[3];
-	int i = find_handle(op->child, handle);
-	void *buf;
+	struct ftable *f = find_handle(op->child, handle);
+	char *buf;
 	struct stat st;
-	struct ftable *ftable = (struct ftable *)op->child->private;
 	ssize_t ret;
 
 	if (options.fake_io) {
 		op->child->bytes += ret_size;
-		op->child->bytes_since_fsync += ret_size;
 		return;
 	}
 
-	buf = calloc(size, 1);
-	memcpy(buf, rw_buf, size);
+	if (f->fd == -1) {
+		return;
+	}
 
-	if (options.one_byte_write_fix &&
-	    size == 1 && fstat(ftable[i].fd, &st) == 0) {
+	buf = write_buf(op->child, size);
+
+	if (options.one_byte_write_fix && !f->direct &&
+	    size == 1 && fstat(f->fd, &st) == 0) {
 		if (st.st_size > offset) {
 			unsigned char c;
-			if (pread(ftable[i].fd, &c, 1, offset) < 0) {
+			if (pread(f->fd, &c, 1, offset) < 0) {
 				return;
 			}
-			if (c == ((unsigned char *)buf)[0]) {
-				free(buf);
+			if (c == (unsigned char)buf[0]) {
 				op->child->bytes += size;
 				return;
 			}
-		} else if (((unsigned char *)buf)[0] == 0) {
-			if (ftruncate(ftable[i].fd, offset+1) < 0) {
-				free(buf);
+		} else if (buf[0] == 0) {
+			if (ftruncate(f->fd, offset+1) < 0) {
 				return;
 			}
-			free(buf);
+			f->size = offset + 1;
 			op->child->bytes += size;
 			return;
 		} 
 	}
 
-	ret = pwrite(ftable[i].fd, buf, size, offset);
+	if (f->direct) {
+		ret = direct_pwrite(op->child, f->fd, buf, size, offset);
+	} else if (!f->nomap) {
+		ret = mmap_pwrite(op->child, f, buf, size, offset);
+	} else {
+		ret = pwrite(f->fd, buf, size, offset);
+	}
+	if (ret > 0 && offset + ret > f->size) {
+		f->size = offset + ret;
+	}
+	if (ret == -1 && f->shared) {
+		return;
+	}
 	if (ret == -1) {
 		printf("[%d] write failed on handle %d (%s)\n", 
 		       op->child->line, handle, strerror(errno));
@@ -372,12 +1363,9 @@ static void fio_writex(struct dbench_op *op)
 		exit(1);
 	}
 
-	if (options.do_fsync) fsync(ftable[i].fd);
-
-	free(buf);
+	fsync_after_write(op->child, f, size);
 
 	op->child->bytes += size;
-	op->child->bytes_since_fsync += size;
 }
 
 static void fio_readx(struct dbench_op *op)
@@ -386,49 +1374,67 @@ static void fio_readx(struct dbench_op *op)
 	int offset = op->params[1];
 	int size = op->params[2];
 	int ret_size = op->params[3];
-	int i = find_handle(op->child, handle);
-	void *buf;
-	struct ftable *ftable = (struct ftable *)op->child->private;
+	struct ftable *f = find_handle(op->child, handle);
+	ssize_t ret;
 
 	if (options.fake_io) {
 		op->child->bytes += ret_size;
 		return;
 	}
 
-	buf = malloc(size);
+	if (f->fd == -1) {
+		return;
+	}
+
+	if (f->direct) {
+		ret = direct_pread(op->child, f->fd, size, offset);
+	} else if (!f->nomap) {
+		ret = mmap_pread(op->child, f, size, offset);
+	} else {
+		ret = pread(f->fd, read_buf(op->child, size), size, offset);
+	}
 
-	if (pread(ftable[i].fd, buf, size, offset) != ret_size) {
+	/* other clients may have truncated a shared file */
+	if (ret != ret_size && !f->shared) {
 		printf("[%d] read failed on handle %d (%s)\n", 
 		       op->child->line, handle, strerror(errno));
 	}
 
-	free(buf);
-
 	op->child->bytes += size;
 }
 
 static void fio_close(struct dbench_op *op)
 {
 	int handle = op->params[0];
-	struct ftable *ftable = (struct ftable *)op->child->private;
-	int i = find_handle(op->child, handle);
-	close(ftable[i].fd);
-	ftable[i].handle = 0;
-	if (ftable[i].name) free(ftable[i].name);
-	ftable[i].name = NULL;
+	struct ftable *f = find_handle(op->child, handle);
+	struct fio_client *fc = op->child->private;
+	if (fc->fsync_enabled && f->fd != -1 &&
+	    ((fc->fsync.when == FSYNC_CLOSE && f->dirty) ||
+	     (fc->fsync.when == FSYNC_MS && fsync_overdue(fc, f)))) {
+		fsync_file(op->child, f);
+	}
+	if (f->map) munmap(f->map, f->map_len);
+	/* mapped pages are not dropped, so this comes after the munmap */
+	if (options.drop_on_close && f->fd != -1) drop_cache(op->child, f->fd);
+	if (f->fd != -1) close(f->fd);
+	ftable_remove(fc, f);
 }
 
 static void fio_rename(struct dbench_op *op)
 {
 	const char *old = op->fname;
 	const char *new = op->fname2;
+	const char *old_name, *new_name;
+	int old_fd, new_fd;
+	int ret;
 
 	resolve_name(op->child, old);
 	resolve_name(op->child, new);
 
 	if (options.stat_check) {
 		struct stat st;
-		if (stat(old, &st) != 0 && expected_status(op->status) == 0) {
+		if (path_stat(op->child, old, &st) != 0 && expected_status(op->status) == 0 &&
+		    !any_status(op->status)) {
 			printf("[%d] rename %s %s failed - file doesn't exist\n",
 			       op->child->line, old, new);
 			failed(op->child);
@@ -436,20 +1442,36 @@ static void fio_rename(struct dbench_op *op)
 		}
 	}
 
-	if (rename(old, new) != expected_status(op->status)) {
+	/* the lookup of old must not close the fd of new */
+	new_fd = path_at(op->child, new, &new_name);
+	old_fd = dir_at(op->child, old, &old_name, 0);
+	ret = renameat(old_fd, old_name, new_fd, new_name);
+	if (ret != expected_status(op->status) &&
+	    !any_status(op->status)) {
 		printf("[%d] rename %s %s failed (%s) - expected %s\n", 
 		       op->child->line, old, new, strerror(errno), op->status);
 		failed(op->child);
 	}
+	if (ret == 0 && (options.dirfd ||
+			 ((struct fio_client *)op->child->private)->names)) {
+		struct stat st;
+		int is_dir = path_stat(op->child, new, &st) == 0 && S_ISDIR(st.st_mode);
+
+		names_remove(op->child, old, is_dir);
+		names_add(op->child, new);
+		if (is_dir) dirfd_forget(op->child, old);
+	}
 	if (options.sync_dirs) sync_parent(op->child, new);
 }
 
 static void fio_flush(struct dbench_op *op)
 {
 	int handle = op->params[0];
-	struct ftable *ftable = (struct ftable *)op->child->private;
-	int i = find_handle(op->child, handle);
-	fsync(ftable[i].fd);
+	struct ftable *f = find_handle(op->child, handle);
+	if (f->fd == -1) return;
+	if (f->map) msync(f->map, f->map_len, MS_SYNC);
+	/* with the method of the --fsync-policy */
+	fsync_file(op->child, f);
 }
 
 static void fio_qpathinfo(struct dbench_op *op)
@@ -461,13 +1483,13 @@ static void fio_qfileinfo(struct dbench_op *op)
 {
 	int handle = op->params[0];
 	int level = op->params[1];
-	struct ftable *ftable = (struct ftable *)op->child->private;
 	struct stat st;
-	int i = find_handle(op->child, handle);
+	struct ftable *f = find_handle(op->child, handle);
 	(void)op->child;
 	(void)level;
-	fstat(ftable[i].fd, &st);
-	xattr_fd_read_hook(op->child, ftable[i].fd);
+	if (f->fd == -1) return;
+	fstat(f->fd, &st);
+	xattr_fd_read_hook(op->child, f->fd);
 }
 
 static void fio_qfsinfo(struct dbench_op *op)
@@ -508,63 +1530,314 @@ static void fio_findfirst(struct dbench_op *op)
 	closedir(dir);
 }
 
-static void fio_deltree(struct dbench_op *op)
-{
+/* read the entries of a directory with large getdents64 calls where the
+   C library has it, otherwise with readdir. Both give d_type, so most
+   entries need no stat */
+struct dir_reader {
+	int fd;
+#ifdef HAVE_GETDENTS64
+	char *buf;
+	size_t used, pos;
+#else
 	DIR *d;
-	struct dirent *de;
-	
-	d = opendir(op->fname);
-	if (d == NULL) return;
+#endif
+};
 
-	for (de = readdir(d); de; de = readdir(d)) {
-		struct stat st;
-		char *fname = NULL;
+static int dir_open(struct dir_reader *r, int fd)
+{
+	r->fd = fd;
+#ifdef HAVE_GETDENTS64
+	r->buf = malloc(DELTREE_BUF_SIZE);
+	r->used = r->pos = 0;
+	return r->buf ? 0 : -1;
+#else
+	r->d = fdopendir(fd);
+	return r->d ? 0 : -1;
+#endif
+}
 
-		if (strcmp(de->d_name, ".") == 0 ||
-		    strcmp(de->d_name, "..") == 0) {
+static void dir_close(struct dir_reader *r)
+{
+#ifdef HAVE_GETDENTS64
+	free(r->buf);
+	close(r->fd);
+#else
+	if (r->d) closedir(r->d);
+	else close(r->fd);
+#endif
+}
+
+/* the next entry other than . and .., with its type. Returns NULL at
+   the end of the directory */
+static const char *dir_next(struct dir_reader *r, unsigned char *type)
+{
+	const char *name;
+
+	do {
+#ifdef HAVE_GETDENTS64
+		struct dirent64 *de;
+		ssize_t n;
+
+		if (r->pos == r->used) {
+			n = getdents64(r->fd, r->buf, DELTREE_BUF_SIZE);
+			if (n <= 0) return NULL;
+			r->used = n;
+			r->pos = 0;
+		}
+		de = (struct dirent64 *)(r->buf + r->pos);
+		r->pos += de->d_reclen;
+#else
+		struct dirent *de = readdir(r->d);
+
+		if (de == NULL) return NULL;
+#endif
+		name = de->d_name;
+		*type = de->d_type;
+	} while (strcmp(name, ".") == 0 || strcmp(name, "..") == 0);
+	return name;
+}
+
+/* the directories still to be emptied by the --cleanup-workers. A
+   directory is a single message on a SOCK_SEQPACKET socketpair, read by
+   whichever worker is idle. pending counts the directories queued or
+   being worked on, the worker that brings it to 0 sends every worker
+   an empty message to make it exit */
+struct deltree_pool {
+	int sock[2];
+	int workers;
+	int *pending;
+};
+
+/* queue a directory for the pool. Returns 0 if the caller has to empty
+   it itself, because there is no pool or the queue is full */
+static int deltree_queue(struct deltree_pool *pool, const char *dname)
+{
+	if (pool == NULL) {
+		return 0;
+	}
+	__atomic_add_fetch(pool->pending, 1, __ATOMIC_ACQ_REL);
+	if (send(pool->sock[0], dname, strlen(dname), MSG_DONTWAIT) == -1) {
+		__atomic_sub_fetch(pool->pending, 1, __ATOMIC_ACQ_REL);
+		return 0;
+	}
+	return 1;
+}
+
+/* unlink the files in the directory open as fd and below it. The
+   directories below it are only removed with rmdirs, which needs them to
+   be walked here rather than by the pool */
+static void deltree_dir(struct child_struct *child, struct deltree_pool *pool,
+			int fd, const char *dname, int rmdirs)
+{
+	struct dir_reader r;
+	unsigned char type;
+	const char *name;
+
+	if (dir_open(&r, fd) != 0) {
+		close(fd);
+		return;
+	}
+	while ((name = dir_next(&r, &type))) {
+		char *path = NULL;
+		int sub;
+
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+
+			if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+		}
+		if (type != DT_DIR) {
+			if (unlinkat(fd, name, 0) != 0) {
+				printf("[%d] unlink '%s/%s' failed - %s\n",
+				       child->line, dname, name, strerror(errno));
+			}
 			continue;
 		}
-		if (asprintf(&fname, "%s/%s", op->fname, de->d_name) < 0) {
+
+		if (asprintf(&path, "%s/%s", dname, name) < 0) {
 			exit(1);
 		}
-		if (fname == NULL) {
-			printf("Out of memory\n");
-			exit(1);
+		if (!deltree_queue(pool, path)) {
+			sub = openat(fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+			if (sub != -1) deltree_dir(child, pool, sub, path, rmdirs);
+			if (rmdirs && unlinkat(fd, name, AT_REMOVEDIR) != 0) {
+				printf("[%d] rmdir '%s' failed - %s\n",
+				       child->line, path, strerror(errno));
+			}
 		}
-		if (stat(fname, &st) != 0) {
+		free(path);
+	}
+	dir_close(&r);
+}
+
+static void deltree_worker(struct child_struct *child, struct deltree_pool *pool)
+{
+	char dname[PATH_MAX];
+	ssize_t len;
+	int fd, i;
+
+	while ((len = recv(pool->sock[1], dname, sizeof(dname) - 1, 0)) > 0) {
+		dname[len] = 0;
+		fd = open(dname, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+		if (fd != -1) deltree_dir(child, pool, fd, dname, 0);
+		if (__atomic_sub_fetch(pool->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+			for (i = 0; i < pool->workers; i++) {
+				send(pool->sock[0], "", 0, 0);
+			}
+		}
+	}
+	fflush(stdout);
+	_exit(0);
+}
+
+/* unlink all files below dname, with a pool of worker processes if
+   there is more than one. With rmdirs the directories are removed as
+   well, by a pass in this process once the pool has removed the files */
+static void deltree(struct child_struct *child, const char *dname,
+		    int workers, int rmdirs)
+{
+	struct deltree_pool pool;
+	pid_t *pids;
+	int fd, i;
+
+	if (workers <= 1) {
+		fd = open(dname, O_RDONLY|O_DIRECTORY);
+		if (fd != -1) deltree_dir(child, NULL, fd, dname, rmdirs);
+		return;
+	}
+
+	pool.workers = workers;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pool.sock) != 0) {
+		printf("socketpair failed - %s\n", strerror(errno));
+		exit(1);
+	}
+	pool.pending = mmap(NULL, sizeof(int), PROT_READ|PROT_WRITE,
+			    MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (pool.pending == MAP_FAILED) {
+		printf("failed to allocate cleanup queue - %s\n", strerror(errno));
+		exit(1);
+	}
+	*pool.pending = 0;
+	if (!deltree_queue(&pool, dname)) {
+		printf("failed to queue %s for cleanup - %s\n", dname, strerror(errno));
+		exit(1);
+	}
+
+	fflush(stdout);
+	pids = calloc(pool.workers, sizeof(pid_t));
+	for (i = 0; i < pool.workers; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			deltree_worker(child, &pool);
+		}
+		if (pids[i] == -1) {
+			/* the workers already running do the work */
+			printf("fork of cleanup worker failed - %s\n", strerror(errno));
+			break;
+		}
+	}
+	if (i == 0) {
+		exit(1);
+	}
+	while (i-- > 0) {
+		waitpid(pids[i], NULL, 0);
+	}
+	free(pids);
+	close(pool.sock[0]);
+	close(pool.sock[1]);
+	munmap(pool.pending, sizeof(int));
+
+	if (rmdirs) {
+		deltree(child, dname, 1, 1);
+	}
+}
+
+static void fio_deltree(struct dbench_op *op)
+{
+	/* the directory itself stays, only its contents go */
+	names_remove(op->child, op->fname, 1);
+	names_add(op->child, op->fname);
+	/* part of the load, so no workers are forked for it */
+	deltree(op->child, op->fname, 1, 0);
+}
+
+/* remove everything whose path starts with a shared prefix, like
+   is_shared() matches them */
+static void remove_shared(struct child_struct *child, const char *prefix)
+{
+	char *path, *base;
+	const char *name;
+	unsigned char type;
+	struct dir_reader r;
+	size_t len;
+	int fd;
+
+	if (asprintf(&path, "%s%s", child->directory, prefix) < 0) {
+		exit(1);
+	}
+	while ((len = strlen(path)) > 1 && path[len - 1] == '/') {
+		path[len - 1] = 0;
+	}
+	base = strrchr(path, '/');
+	if (base == NULL || base == path) {
+		free(path);
+		return;
+	}
+	*base++ = 0;
+	len = strlen(base);
+
+	fd = open(path, O_RDONLY|O_DIRECTORY);
+	if (fd == -1 || dir_open(&r, fd) != 0) {
+		if (fd != -1) close(fd);
+		free(path);
+		return;
+	}
+	while ((name = dir_next(&r, &type))) {
+		char *fname;
+		struct stat st;
+
+		if (strncmp(name, base, len) != 0) {
 			continue;
 		}
-		if (S_ISDIR(st.st_mode)) {
-			struct dbench_op op2 = *op;
-			op2.fname = fname;
-			fio_deltree(&op2);
+		if (asprintf(&fname, "%s/%s", path, name) < 0) {
+			exit(1);
+		}
+		if (lstat(fname, &st) == 0 && S_ISDIR(st.st_mode)) {
+			deltree(child, fname, options.cleanup_workers, 1);
+			rmdir(fname);
 		} else {
-			if (unlink(fname) != 0) {
-				printf("[%d] unlink '%s' failed - %s\n",
-				       op->child->line, fname, strerror(errno));
-			}
+			unlink(fname);
 		}
 		free(fname);
 	}
-	closedir(d);
+	dir_close(&r);
+	free(path);
 }
 
 static void fio_cleanup(struct child_struct *child)
 {
+	const char *prefix;
 	char *dname;
-	struct dbench_op op;
-
-	ZERO_STRUCT(op);
+	unsigned i;
 
 	if (asprintf(&dname, "%s/clients/client%d", child->directory,
 		     child->id) < 0) {
 		exit(1);
 	}
-	op.child = child;
-	op.fname = dname;
-	fio_deltree(&op);
+	deltree(child, dname, options.cleanup_workers, 1);
+	rmdir(dname);
 	free(dname);
 
+	/* the paths shared by all clients are removed once */
+	if (child->id == 0) {
+		for (i = 0; (prefix = get_shared_prefix(i)); i++) {
+			remove_shared(child, prefix);
+		}
+	}
+
 	if (asprintf(&dname, "%s%s", child->directory, "/clients") < 0) {
 		exit(1);
 	}
@@ -577,24 +1850,37 @@ static void fio_sfileinfo(struct dbench_op *op)
 {
 	int handle = op->params[0];
 	int level = op->params[1];
-	struct ftable *ftable = (struct ftable *)op->child->private;
-	int i = find_handle(op->child, handle);
+	struct ftable *f = find_handle(op->child, handle);
 	struct utimbuf tm;
 	struct stat st;
 	(void)op->child;
 	(void)handle;
 	(void)level;
-	xattr_fd_read_hook(op->child, ftable[i].fd);
+	if (f->fd == -1) {
+		return;
+	}
+	xattr_fd_read_hook(op->child, f->fd);
 
-	fstat(ftable[i].fd, &st);
+	fstat(f->fd, &st);
 
 	tm.actime = st.st_atime - 10;
 	tm.modtime = st.st_mtime - 12;
 
-	utime(ftable[i].name, &tm);
+	if (options.dirfd) {
+		/* the file is open, there is no need to look it up again */
+		struct timespec ts[2];
+
+		ts[0].tv_sec = tm.actime;
+		ts[0].tv_nsec = 0;
+		ts[1].tv_sec = tm.modtime;
+		ts[1].tv_nsec = 0;
+		futimens(f->fd, ts);
+	} else {
+		utime(f->name, &tm);
+	}
 
 	if (!S_ISDIR(st.st_mode)) {
-		xattr_fd_write_hook(op->child, ftable[i].fd);
+		xattr_fd_write_hook(op->child, f->fd);
 	}
 }
 
@@ -603,19 +1889,20 @@ static void fio_lockx(struct dbench_op *op)
 	int handle = op->params[0];
 	uint32_t offset = op->params[1];
 	int size = op->params[2];
-	struct ftable *ftable = (struct ftable *)op->child->private;
-	int i = find_handle(op->child, handle);
+	struct ftable *f = find_handle(op->child, handle);
 	struct flock lock;
 
 	(void)op->child;
 
+	if (f->fd == -1) return;
+
 	lock.l_type = F_WRLCK;
 	lock.l_whence = SEEK_SET;
 	lock.l_start = offset;
 	lock.l_len = size;
 	lock.l_pid = 0;
 
-	fcntl(ftable[i].fd, F_SETLKW, &lock);
+	fcntl(f->fd, F_SETLKW, &lock);
 }
 
 static void fio_unlockx(struct dbench_op *op)
@@ -623,17 +1910,18 @@ static void fio_unlockx(struct dbench_op *op)
 	int handle = op->params[0];
 	uint32_t offset = op->params[1];
 	int size = op->params[2];
-	struct ftable *ftable = (struct ftable *)op->child->private;
-	int i = find_handle(op->child, handle);
+	struct ftable *f = find_handle(op->child, handle);
 	struct flock lock;
 
+	if (f->fd == -1) return;
+
 	lock.l_type = F_UNLCK;
 	lock.l_whence = SEEK_SET;
 	lock.l_start = offset;
 	lock.l_len = size;
 	lock.l_pid = 0;
 
-	fcntl(ftable[i].fd, F_SETLKW, &lock);
+	fcntl(f->fd, F_SETLKW, &lock);
 }
 
 static struct backend_op ops[] = {
@@ -661,5 +1949,7 @@ struct nb_operations fileio_ops = {
 	.backend_name = "dbench",
 	.setup 		= fio_setup,
 	.cleanup	= fio_cleanup,
+	.drop_cache	= fio_drop_cache,
+	.before_op	= fio_before_op,
 	.ops          = ops
 };
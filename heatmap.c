@@ -0,0 +1,266 @@
+/*
+   dbench latency heatmaps
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Keep the difference of the latency histograms of every operation
+   between reporting intervals, and write them out at the end of the run
+   as a time by latency heatmap per operation. This shows bimodal latency
+   such as flushes stalling behind journal commits, which the average and
+   maximum in the latency table hide.
+*/
+
+#include "dbench.h"
+#include <math.h>
+
+/* size of a cell in the SVG output */
+#define SVG_CELL_WIDTH 6
+#define SVG_CELL_HEIGHT 10
+#define SVG_LABEL_WIDTH 90
+#define SVG_PANEL_SPACE 40
+
+/* one heatmap per operation of every backend in use */
+static struct {
+	struct nb_operations *backend;
+	unsigned op;
+} slots[MAX_BACKENDS * MAX_OPS];
+static unsigned num_ops;
+static unsigned prev[MAX_BACKENDS * MAX_OPS][LAT_HIST_BUCKETS];
+/* num_intervals * num_ops histograms */
+static unsigned *intervals;
+static double *times;
+static unsigned num_intervals, allocated;
+
+#define HIST(interval, op) (&intervals[((interval) * num_ops + (op)) * LAT_HIST_BUCKETS])
+
+/*
+  record the latencies of the interval ending t seconds into the run
+*/
+void heatmap_sample(struct child_struct *children, int nclients, double t)
+{
+	unsigned cur[LAT_HIST_BUCKETS];
+	unsigned *hist;
+	unsigned op, b;
+	int i;
+
+	if (num_ops == 0) {
+		int n;
+
+		for (n = 0; n < num_backends; n++) {
+			for (op = 0; backends[n]->ops[op].name; op++) {
+				slots[num_ops].backend = backends[n];
+				slots[num_ops++].op = op;
+			}
+		}
+	}
+	if (num_intervals == allocated) {
+		allocated = allocated ? allocated * 2 : 64;
+		intervals = realloc(intervals, allocated * num_ops * LAT_HIST_BUCKETS * sizeof(unsigned));
+		times = realloc(times, allocated * sizeof(double));
+		if (intervals == NULL || times == NULL) {
+			printf("failed to allocate heatmap\n");
+			exit(1);
+		}
+	}
+
+	for (op = 0; op < num_ops; op++) {
+		memset(cur, 0, sizeof(cur));
+		for (i = 0; i < nclients; i++) {
+			if (children[i].backend != slots[op].backend) {
+				continue;
+			}
+			for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+				cur[b] += children[i].ops[slots[op].op].hist[b];
+			}
+		}
+		hist = HIST(num_intervals, op);
+		for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+			hist[b] = cur[b] - prev[op][b];
+			prev[op][b] = cur[b];
+		}
+	}
+	times[num_intervals++] = t;
+}
+
+/* the name of an operation, qualified by the backend in mixed runs */
+static const char *op_name(unsigned op)
+{
+	static char name[64];
+
+	if (num_backends == 1) {
+		return slots[op].backend->ops[slots[op].op].name;
+	}
+	snprintf(name, sizeof(name), "%s/%s", slots[op].backend->backend_name,
+		 slots[op].backend->ops[slots[op].op].name);
+	return name;
+}
+
+/* the range of buckets used by an operation and the largest cell */
+static unsigned op_range(unsigned op, int *lo, int *hi)
+{
+	unsigned i, max = 0;
+	int b;
+
+	*lo = LAT_HIST_BUCKETS;
+	*hi = -1;
+	for (i = 0; i < num_intervals; i++) {
+		unsigned *hist = HIST(i, op);
+
+		for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+			if (hist[b] == 0) {
+				continue;
+			}
+			*lo = MIN(*lo, b);
+			*hi = MAX(*hi, b);
+			max = MAX(max, hist[b]);
+		}
+	}
+	return max;
+}
+
+static void heatmap_text(FILE *f)
+{
+	unsigned op, i, max;
+	int lo, hi, b;
+
+	for (op = 0; op < num_ops; op++) {
+		max = op_range(op, &lo, &hi);
+		if (max == 0) {
+			continue;
+		}
+		fprintf(f, "%s latency over %.0f sec, one column per interval, max %u per cell\n",
+			op_name(op), times[num_intervals - 1], max);
+		for (b = hi; b >= lo; b--) {
+			fprintf(f, " <%9.03f ms |", latency_bucket_limit(b) * 1000);
+			for (i = 0; i < num_intervals; i++) {
+				fputc(heatmap_shade(HIST(i, op)[b], max), f);
+			}
+			fprintf(f, "|\n");
+		}
+		fprintf(f, "\n");
+	}
+}
+
+static void heatmap_json(FILE *f)
+{
+	unsigned op, i, b, n = 0;
+
+	fprintf(f, "{\n  \"time\": [");
+	for (i = 0; i < num_intervals; i++) {
+		fprintf(f, "%s%.3f", i ? ", " : "", times[i]);
+	}
+	fprintf(f, "],\n  \"bucket_limit_ms\": [");
+	for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+		fprintf(f, "%s%g", b ? ", " : "", latency_bucket_limit(b) * 1000);
+	}
+	fprintf(f, "],\n  \"ops\": {");
+	for (op = 0; op < num_ops; op++) {
+		int lo, hi;
+
+		if (op_range(op, &lo, &hi) == 0) {
+			continue;
+		}
+		fprintf(f, "%s\n    \"%s\": [", n++ ? "," : "", op_name(op));
+		for (i = 0; i < num_intervals; i++) {
+			fprintf(f, "%s\n      [", i ? "," : "");
+			for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+				fprintf(f, "%s%u", b ? ", " : "", HIST(i, op)[b]);
+			}
+			fprintf(f, "]");
+		}
+		fprintf(f, "\n    ]");
+	}
+	fprintf(f, "\n  }\n}\n");
+}
+
+static void heatmap_svg(FILE *f)
+{
+	unsigned op, i, max, width, height = 0;
+	int lo, hi, b, y;
+
+	/* leave room for the titles on short runs */
+	width = MAX(SVG_LABEL_WIDTH + num_intervals * SVG_CELL_WIDTH + 10, 400);
+	for (op = 0; op < num_ops; op++) {
+		if (op_range(op, &lo, &hi) != 0) {
+			height += (hi - lo + 1) * SVG_CELL_HEIGHT + SVG_PANEL_SPACE;
+		}
+	}
+
+	fprintf(f, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%u\" height=\"%u\" "
+		"font-family=\"monospace\" font-size=\"9\">\n", width, height);
+	fprintf(f, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+
+	y = 0;
+	for (op = 0; op < num_ops; op++) {
+		max = op_range(op, &lo, &hi);
+		if (max == 0) {
+			continue;
+		}
+		y += 14;
+		fprintf(f, "<text x=\"0\" y=\"%d\" font-size=\"11\">%s latency over %.0f sec, max %u per cell</text>\n",
+			y, op_name(op), times[num_intervals - 1], max);
+		y += 4;
+		for (b = hi; b >= lo; b--) {
+			fprintf(f, "<text x=\"0\" y=\"%d\">&lt;%.3f ms</text>\n",
+				y + SVG_CELL_HEIGHT - 2, latency_bucket_limit(b) * 1000);
+			for (i = 0; i < num_intervals; i++) {
+				unsigned count = HIST(i, op)[b];
+				double v;
+
+				if (count == 0) {
+					continue;
+				}
+				/* log scale, like the text output */
+				v = max > 1 ? 0.15 + 0.85 * log(count) / log(max) : 1;
+				fprintf(f, "<rect x=\"%u\" y=\"%d\" width=\"%d\" height=\"%d\" "
+					"fill=\"rgb(255,%d,%d)\"><title>%u</title></rect>\n",
+					SVG_LABEL_WIDTH + i * SVG_CELL_WIDTH, y,
+					SVG_CELL_WIDTH, SVG_CELL_HEIGHT,
+					(int)(255 * (1 - v)), (int)(255 * (1 - v)), count);
+			}
+			y += SVG_CELL_HEIGHT;
+		}
+		y += SVG_PANEL_SPACE - 18;
+	}
+	fprintf(f, "</svg>\n");
+}
+
+/*
+  write the heatmaps in text, svg or json format
+*/
+void heatmap_write(const char *fname, const char *format)
+{
+	FILE *f;
+
+	if (num_intervals == 0) {
+		printf("no intervals were recorded for the heatmap\n");
+		return;
+	}
+
+	f = fopen(fname, "w");
+	if (f == NULL) {
+		printf("failed to create heatmap %s: %s\n", fname, strerror(errno));
+		return;
+	}
+	if (strcmp(format, "svg") == 0) {
+		heatmap_svg(f);
+	} else if (strcmp(format, "json") == 0) {
+		heatmap_json(f);
+	} else {
+		heatmap_text(f);
+	}
+	fclose(f);
+	printf("Latency heatmap written to %s\n", fname);
+}
@@ -0,0 +1,273 @@
+/*
+   dbench live metrics endpoint
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Serve the live state of a run in OpenMetrics text format over HTTP, on
+   either a TCP port on the loopback interface or a unix domain socket.
+
+   The listening socket is non-blocking and pending connections are
+   answered by the parent from sig_alarm(), so a scrape is answered
+   within one reporting interval without needing another process.
+*/
+
+#include "dbench.h"
+#include <sys/un.h>
+
+static int metrics_fd = -1;
+
+/*
+  start listening on "<port>" or "unix:<path>". Returns 0 on success
+*/
+int metrics_listen(const char *spec)
+{
+	int one = 1;
+
+	if (strncmp(spec, "unix:", 5) == 0) {
+		struct sockaddr_un sun;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, spec + 5, sizeof(sun.sun_path) - 1);
+		unlink(sun.sun_path);
+
+		metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (metrics_fd == -1 ||
+		    bind(metrics_fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+			goto failed;
+		}
+	} else {
+		struct sockaddr_in sin;
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(atoi(spec));
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		metrics_fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (metrics_fd == -1) {
+			goto failed;
+		}
+		setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(metrics_fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+			goto failed;
+		}
+	}
+
+	if (listen(metrics_fd, 16) != 0) {
+		goto failed;
+	}
+	fcntl(metrics_fd, F_SETFL, fcntl(metrics_fd, F_GETFL) | O_NONBLOCK);
+	fcntl(metrics_fd, F_SETFD, FD_CLOEXEC);
+	return 0;
+
+failed:
+	printf("failed to listen for metrics on %s: %s\n", spec, strerror(errno));
+	if (metrics_fd != -1) {
+		close(metrics_fd);
+		metrics_fd = -1;
+	}
+	return -1;
+}
+
+/* the number of operations op of all clients using a backend */
+static unsigned op_count(struct child_struct *children, int nclients,
+			 struct nb_operations *backend, int op)
+{
+	unsigned count = 0;
+	int i;
+
+	for (i = 0; i < nclients; i++) {
+		if (children[i].backend == backend) {
+			count += children[i].ops[op].count;
+		}
+	}
+	return count;
+}
+
+static void metrics_format(FILE *f, struct child_struct *children,
+			   int nclients, const char *phase, int num_active,
+			   double throughput)
+{
+	static const char *phases[] = { "warmup", "execute", "cleanup" };
+	static unsigned prev_count[MAX_BACKENDS][MAX_OPS];
+	static struct timespec prev_time;
+	struct timespec now = timespec_current();
+	double t = prev_time.tv_sec ? timespec_elapsed2(&prev_time, &now) : 0;
+	double bytes = 0;
+	unsigned i, j, k;
+	int b;
+
+	fprintf(f, "# TYPE dbench_phase stateset\n");
+	for (i = 0; i < sizeof(phases)/sizeof(phases[0]); i++) {
+		fprintf(f, "dbench_phase{dbench_phase=\"%s\"} %d\n",
+			phases[i], strcmp(phase, phases[i]) == 0);
+	}
+
+	fprintf(f, "# TYPE dbench_clients gauge\n");
+	fprintf(f, "# HELP dbench_clients Number of clients that are running the load.\n");
+	fprintf(f, "dbench_clients %d\n", num_active);
+
+	for (i = 0; i < (unsigned)nclients; i++) {
+		bytes += children[i].bytes - children[i].bytes_done_warmup;
+	}
+	fprintf(f, "# TYPE dbench_bytes counter\n");
+	fprintf(f, "# UNIT dbench_bytes bytes\n");
+	fprintf(f, "dbench_bytes_total %.0f\n", bytes);
+
+	fprintf(f, "# TYPE dbench_throughput_megabytes_per_second gauge\n");
+	fprintf(f, "dbench_throughput_megabytes_per_second %.3f\n", throughput);
+
+	fprintf(f, "# TYPE dbench_operations counter\n");
+	for (b = 0; b < num_backends; b++) {
+		struct nb_operations *backend = backends[b];
+
+		for (i = 0; backend->ops[i].name; i++) {
+			fprintf(f, "dbench_operations_total{backend=\"%s\",op=\"%s\"} %u\n",
+				backend->backend_name, backend->ops[i].name,
+				op_count(children, nclients, backend, i));
+		}
+	}
+
+	/* the rate since the previous scrape, for consumers that do not
+	   compute rates from the counters themselves */
+	fprintf(f, "# TYPE dbench_operations_per_second gauge\n");
+	for (b = 0; b < num_backends; b++) {
+		struct nb_operations *backend = backends[b];
+
+		for (i = 0; backend->ops[i].name; i++) {
+			unsigned count = op_count(children, nclients, backend, i);
+
+			fprintf(f, "dbench_operations_per_second{backend=\"%s\",op=\"%s\"} %.3f\n",
+				backend->backend_name, backend->ops[i].name,
+				(t > 0 && count >= prev_count[b][i]) ? (count - prev_count[b][i]) / t : 0);
+			prev_count[b][i] = count;
+		}
+	}
+	prev_time = now;
+
+	fprintf(f, "# TYPE dbench_operation_latency_seconds histogram\n");
+	fprintf(f, "# UNIT dbench_operation_latency_seconds seconds\n");
+	for (b = 0; b < num_backends; b++) {
+		struct nb_operations *backend = backends[b];
+
+		for (i = 0; backend->ops[i].name; i++) {
+			unsigned hist[LAT_HIST_BUCKETS];
+			unsigned count = 0;
+			double sum = 0;
+
+			memset(hist, 0, sizeof(hist));
+			for (j = 0; j < (unsigned)nclients; j++) {
+				struct op *op = &children[j].ops[i];
+
+				if (children[j].backend != backend) {
+					continue;
+				}
+				for (k = 0; k < LAT_HIST_BUCKETS; k++) {
+					hist[k] += op->hist[k];
+				}
+				sum += op->total_time;
+			}
+			for (k = 0; k < LAT_HIST_BUCKETS - 1; k++) {
+				count += hist[k];
+				fprintf(f, "dbench_operation_latency_seconds_bucket{backend=\"%s\",op=\"%s\",le=\"%g\"} %u\n",
+					backend->backend_name, backend->ops[i].name,
+					latency_bucket_limit(k), count);
+			}
+			count += hist[k];
+			fprintf(f, "dbench_operation_latency_seconds_bucket{backend=\"%s\",op=\"%s\",le=\"+Inf\"} %u\n",
+				backend->backend_name, backend->ops[i].name, count);
+			fprintf(f, "dbench_operation_latency_seconds_count{backend=\"%s\",op=\"%s\"} %u\n",
+				backend->backend_name, backend->ops[i].name, count);
+			fprintf(f, "dbench_operation_latency_seconds_sum{backend=\"%s\",op=\"%s\"} %.6f\n",
+				backend->backend_name, backend->ops[i].name, sum);
+		}
+	}
+
+	fprintf(f, "# EOF\n");
+}
+
+/* send all of buf without raising SIGPIPE, which would kill the parent.
+   A scraper that went away is not an error */
+static void metrics_send(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			if (n == -1 && errno != EPIPE && errno != ECONNRESET) {
+				printf("failed to send metrics: %s\n", strerror(errno));
+			}
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+  answer all pending scrapes
+*/
+void metrics_serve(struct child_struct *children, int nclients,
+		   const char *phase, int num_active, double throughput)
+{
+	struct timeval timeout = { 0, 100000 };
+	char request[4096];
+	char header[256];
+	char *body = NULL;
+	int len;
+	size_t body_len = 0;
+	FILE *f;
+	int fd;
+
+	if (metrics_fd == -1) {
+		return;
+	}
+
+	while ((fd = accept(metrics_fd, NULL, NULL)) != -1) {
+		/* the request itself is not interesting, every path returns
+		   the metrics. It still has to be read, closing a socket
+		   with unread data resets the connection */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		if (recv(fd, request, sizeof(request), 0) < 0) {
+			request[0] = 0;
+		}
+
+		if (body == NULL) {
+			f = open_memstream(&body, &body_len);
+			if (f == NULL) {
+				close(fd);
+				return;
+			}
+			metrics_format(f, children, nclients, phase, num_active,
+				       throughput);
+			fclose(f);
+		}
+
+		len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+			"Content-Length: %lu\r\n"
+			"Connection: close\r\n\r\n", (unsigned long)body_len);
+		metrics_send(fd, header, len);
+		metrics_send(fd, body, body_len);
+		close(fd);
+	}
+
+	free(body);
+}
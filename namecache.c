@@ -0,0 +1,266 @@
+/*
+   dbench case insensitive name cache
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Model the stat cache of smbd. When a name does not exist with the
+   case the client used, the fileio backend looks for it with any case
+   by reading the whole parent directory. With the cache, a directory
+   is only read the first time, into a hash table of case folded names.
+   Later lookups in it are a single hash probe. Creates, renames and
+   unlinks by the client update the cached directories, so the cache
+   stays correct as long as nothing else changes them.
+*/
+
+#include "dbench.h"
+
+#define NAME_CACHE_DIRS 1024
+#define NAME_CACHE_MIN_NAMES 16
+
+struct cached_name {
+	struct cached_name *next;
+	uint32_t hash;
+	char name[1];
+};
+
+struct cached_dir {
+	struct cached_dir *next;
+	uint32_t hash;
+	char *path;
+	/* hash table of case folded names, a power of 2 in size */
+	struct cached_name **names;
+	unsigned size, count;
+};
+
+struct name_cache {
+	struct cached_dir *dirs[NAME_CACHE_DIRS];
+};
+
+static uint32_t name_hash(const char *s, size_t len, int fold)
+{
+	uint32_t hash = 5381;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash = hash * 33 + (fold ? tolower((unsigned char)s[i]) :
+				    (unsigned char)s[i]);
+	}
+	return hash;
+}
+
+struct name_cache *name_cache_init(void)
+{
+	struct name_cache *nc = calloc(1, sizeof(*nc));
+
+	if (nc == NULL) {
+		printf("failed to allocate name cache\n");
+		exit(1);
+	}
+	return nc;
+}
+
+static struct cached_dir **find_dir(struct name_cache *nc, const char *path,
+				    size_t len)
+{
+	uint32_t hash = name_hash(path, len, 0);
+	struct cached_dir **d;
+
+	for (d = &nc->dirs[hash % NAME_CACHE_DIRS]; *d; d = &(*d)->next) {
+		if ((*d)->hash == hash && strncmp((*d)->path, path, len) == 0 &&
+		    (*d)->path[len] == 0) {
+			break;
+		}
+	}
+	return d;
+}
+
+static struct cached_name **find_name(struct cached_dir *dir, const char *name)
+{
+	uint32_t hash = name_hash(name, strlen(name), 1);
+	struct cached_name **n;
+
+	for (n = &dir->names[hash & (dir->size - 1)]; *n; n = &(*n)->next) {
+		if ((*n)->hash == hash && strcasecmp((*n)->name, name) == 0) {
+			break;
+		}
+	}
+	return n;
+}
+
+static void add_name(struct cached_dir *dir, const char *name)
+{
+	struct cached_name **n, *e;
+	size_t len;
+	unsigned i;
+
+	if (*find_name(dir, name)) {
+		return;
+	}
+
+	/* keep the chains short as the directory grows */
+	if (dir->count >= dir->size) {
+		struct cached_name **old = dir->names;
+		unsigned old_size = dir->size;
+
+		dir->size *= 2;
+		dir->names = calloc(dir->size, sizeof(*dir->names));
+		for (i = 0; i < old_size; i++) {
+			while ((e = old[i])) {
+				old[i] = e->next;
+				e->next = dir->names[e->hash & (dir->size - 1)];
+				dir->names[e->hash & (dir->size - 1)] = e;
+			}
+		}
+		free(old);
+	}
+
+	len = strlen(name);
+	e = malloc(sizeof(*e) + len);
+	e->hash = name_hash(name, len, 1);
+	memcpy(e->name, name, len + 1);
+	n = &dir->names[e->hash & (dir->size - 1)];
+	e->next = *n;
+	*n = e;
+	dir->count++;
+}
+
+static void free_dir(struct cached_dir *dir)
+{
+	struct cached_name *e;
+	unsigned i;
+
+	for (i = 0; i < dir->size; i++) {
+		while ((e = dir->names[i])) {
+			dir->names[i] = e->next;
+			free(e);
+		}
+	}
+	free(dir->names);
+	free(dir->path);
+	free(dir);
+}
+
+/* read a directory into the cache */
+static struct cached_dir *load_dir(struct child_struct *child,
+				   struct cached_dir **slot, const char *path)
+{
+	struct cached_dir *dir;
+	struct dirent *d;
+	DIR *dh;
+
+	dh = opendir(path);
+	if (dh == NULL) {
+		return NULL;
+	}
+	child->counters[COUNTER_DIR_SCAN]++;
+
+	dir = calloc(1, sizeof(*dir));
+	dir->path = strdup(path);
+	dir->hash = name_hash(path, strlen(path), 0);
+	dir->size = NAME_CACHE_MIN_NAMES;
+	dir->names = calloc(dir->size, sizeof(*dir->names));
+	while ((d = readdir(dh))) {
+		child->counters[COUNTER_DIR_SCAN_ENTRIES]++;
+		add_name(dir, d->d_name);
+	}
+	closedir(dh);
+
+	dir->next = *slot;
+	*slot = dir;
+	return dir;
+}
+
+/*
+  look for fname in directory dname ignoring case, reading the directory
+  on the first lookup in it. Returns 1 if the name exists
+*/
+int name_cache_lookup(struct name_cache *nc, struct child_struct *child,
+		      const char *dname, const char *fname)
+{
+	struct cached_dir **slot = find_dir(nc, dname, strlen(dname));
+	struct cached_dir *dir = *slot;
+
+	if (dir) {
+		child->counters[COUNTER_NAME_CACHE_HIT]++;
+	} else {
+		child->counters[COUNTER_NAME_CACHE_MISS]++;
+		dir = load_dir(child, slot, dname);
+		if (dir == NULL) {
+			return 0;
+		}
+	}
+	return *find_name(dir, fname) != NULL;
+}
+
+/* the cached directory holding path, and the name within it */
+static struct cached_dir *parent_dir(struct name_cache *nc, const char *path,
+				     const char **name)
+{
+	const char *p = strrchr(path, '/');
+
+	if (p == NULL) {
+		return NULL;
+	}
+	*name = p + 1;
+	return *find_dir(nc, path, p - path);
+}
+
+/*
+  a file or directory was created, or renamed to path
+*/
+void name_cache_add(struct name_cache *nc, const char *path)
+{
+	const char *name;
+	struct cached_dir *dir = parent_dir(nc, path, &name);
+
+	if (dir) {
+		add_name(dir, name);
+	}
+}
+
+/*
+  a file or directory was removed, or renamed away from path. For a
+  directory the cached directories below it are dropped as well
+*/
+void name_cache_remove(struct name_cache *nc, const char *path, int is_dir)
+{
+	size_t len = strlen(path);
+	struct cached_dir **d, *dir;
+	struct cached_name **n, *e;
+	const char *name;
+	unsigned i;
+
+	dir = parent_dir(nc, path, &name);
+	if (dir && (e = *(n = find_name(dir, name)))) {
+		*n = e->next;
+		free(e);
+		dir->count--;
+	}
+	if (!is_dir) {
+		return;
+	}
+
+	for (i = 0; i < NAME_CACHE_DIRS; i++) {
+		for (d = &nc->dirs[i]; (dir = *d); ) {
+			if (strncmp(dir->path, path, len) == 0 &&
+			    (dir->path[len] == 0 || dir->path[len] == '/')) {
+				*d = dir->next;
+				free_dir(dir);
+			} else {
+				d = &dir->next;
+			}
+		}
+	}
+}
@@ -62,7 +62,7 @@ static void nfs3_setup(struct child_struct *child)
 	nfsstat3 res;
 	char *url;
 
-	child->rate.last_time = timeval_current();
+	child->rate.last_time = timespec_current();
 	child->rate.last_bytes = 0;
 
 	srandom(getpid() ^ time(NULL));
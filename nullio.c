@@ -0,0 +1,138 @@
+/*
+   dbench null backend
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The null backend accepts the commands of all the other backends and
+   counts them, but does not perform any I/O. This is --fake-io for every
+   operation and is used to measure how many operations per second dbench
+   itself can drive before the tool becomes the bottleneck.
+*/
+
+#include "dbench.h"
+
+/* SCSI commands carry their transfer length in blocks */
+#define NULL_BLOCK_SIZE 512
+
+static void null_setup(struct child_struct *child)
+{
+	child->rate.last_time = timespec_current();
+	child->rate.last_bytes = 0;
+}
+
+static void null_cleanup(struct child_struct *child)
+{
+	(void)child;
+}
+
+static void null_op(struct dbench_op *op)
+{
+	(void)op;
+}
+
+/* ReadX/WriteX <handle> <offset> <size> <ret_size> */
+static void null_readx(struct dbench_op *op)
+{
+	op->child->bytes += op->params[3];
+}
+
+static void null_writex(struct dbench_op *op)
+{
+	op->child->bytes += op->params[2];
+}
+
+/* READ3/WRITE3 and the SMB/block READ/WRITE take <offset> <length> */
+static void null_read(struct dbench_op *op)
+{
+	op->child->bytes += op->params[1];
+}
+
+static void null_write(struct dbench_op *op)
+{
+	op->child->bytes += op->params[1];
+}
+
+/* READ10/WRITE10 etc take <lba> <xferlen> */
+static void null_scsi_io(struct dbench_op *op)
+{
+	op->child->bytes += op->params[1] * NULL_BLOCK_SIZE;
+}
+
+static struct backend_op ops[] = {
+	/* fileio and sockio */
+	{ "Deltree", null_op },
+	{ "Flush", null_op },
+	{ "Close", null_op },
+	{ "LockX", null_op },
+	{ "Rmdir", null_op },
+	{ "Mkdir", null_op },
+	{ "Rename", null_op },
+	{ "ReadX", null_readx },
+	{ "WriteX", null_writex },
+	{ "Unlink", null_op },
+	{ "UnlockX", null_op },
+	{ "FIND_FIRST", null_op },
+	{ "SET_FILE_INFORMATION", null_op },
+	{ "QUERY_FILE_INFORMATION", null_op },
+	{ "QUERY_PATH_INFORMATION", null_op },
+	{ "QUERY_FS_INFORMATION", null_op },
+	{ "NTCreateX", null_op },
+	/* nfs */
+	{ "ACCESS3", null_op },
+	{ "COMMIT3", null_op },
+	{ "CREATE3", null_op },
+	{ "FSINFO3", null_op },
+	{ "FSSTAT3", null_op },
+	{ "GETATTR3", null_op },
+	{ "LINK3", null_op },
+	{ "LOOKUP3", null_op },
+	{ "MKDIR3", null_op },
+	{ "PATHCONF3", null_op },
+	{ "READ3", null_read },
+	{ "READDIRPLUS3", null_op },
+	{ "READLINK3", null_op },
+	{ "REMOVE3", null_op },
+	{ "RENAME3", null_op },
+	{ "RMDIR3", null_op },
+	{ "SETATTR3", null_op },
+	{ "SYMLINK3", null_op },
+	{ "WRITE3", null_write },
+	{ "LOCK4", null_op },
+	{ "UNLOCK4", null_op },
+	{ "TEST4", null_op },
+	/* smb and block */
+	{ "OPEN", null_op },
+	{ "READ", null_read },
+	{ "READDIR", null_op },
+	{ "WRITE", null_write },
+	{ "FDATASYNC", null_op },
+	/* scsi and iscsi */
+	{ "TESTUNITREADY", null_op },
+	{ "READ6", null_scsi_io },
+	{ "READ10", null_scsi_io },
+	{ "READ16", null_scsi_io },
+	{ "READCAPACITY10", null_op },
+	{ "SYNCHRONIZECACHE10", null_op },
+	{ "WRITE10", null_scsi_io },
+	{ "WRITE16", null_scsi_io },
+	{ NULL, NULL}
+};
+
+struct nb_operations null_ops = {
+	.backend_name = "null",
+	.setup 	      = null_setup,
+	.cleanup      = null_cleanup,
+	.ops          = ops
+};
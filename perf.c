@@ -0,0 +1,170 @@
+/*
+   dbench hardware performance counters
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Count cycles, instructions, cache misses and page faults of the
+   calling thread with perf_event_open(). The counters are opened as one
+   group so that a single read() returns all of them, which keeps the
+   cost of sampling them around every operation low.
+*/
+
+#include "dbench.h"
+
+const char *perf_counter_names[NUM_PERF_COUNTERS] = {
+	"Cycles",
+	"Instructions",
+	"CacheMisses",
+	"PageFaults",
+};
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} perf_events[NUM_PERF_COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+/* the first hardware counter that could be opened leads the group. A
+   software event can not lead hardware events, so without a hardware
+   leader the software counters are read on their own */
+static int perf_leader = -1;
+static int perf_nr;
+static int perf_idx[NUM_PERF_COUNTERS];
+static int perf_fd[NUM_PERF_COUNTERS];
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+	return syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+static int perf_open_counter(int idx, int exclude_kernel)
+{
+	struct perf_event_attr attr;
+	int grouped = perf_leader != -1 ||
+		perf_events[idx].type == PERF_TYPE_HARDWARE;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perf_events[idx].type;
+	attr.config = perf_events[idx].config;
+	attr.read_format = grouped ? PERF_FORMAT_GROUP : 0;
+	attr.exclude_kernel = exclude_kernel;
+	attr.exclude_hv = 1;
+
+	return perf_event_open(&attr, perf_leader);
+}
+
+/*
+  open the counters for the calling process. Counters the cpu or the
+  virtual machine does not provide are skipped. Returns 0 if at least one
+  counter could be opened
+*/
+int perf_setup(void)
+{
+	/* perf_event_paranoid may only allow counting user space */
+	int exclude_kernel = 0;
+	int opened[NUM_PERF_COUNTERS];
+	int fd, i, found, nopened;
+
+again:
+	found = 0;
+	nopened = 0;
+	for (i = 0; i < NUM_PERF_COUNTERS; i++) {
+		perf_fd[i] = -1;
+		fd = perf_open_counter(i, exclude_kernel);
+		if (fd == -1 && (errno == EACCES || errno == EPERM) &&
+		    !exclude_kernel) {
+			/* start over so that all counters count the same
+			   thing */
+			while (nopened > 0) {
+				close(opened[--nopened]);
+			}
+			perf_leader = -1;
+			perf_nr = 0;
+			exclude_kernel = 1;
+			printf("perf counters exclude the kernel: %s\n",
+			       strerror(errno));
+			goto again;
+		}
+		if (fd == -1) {
+			printf("perf counter %s not available: %s\n",
+			       perf_counter_names[i], strerror(errno));
+			continue;
+		}
+		found = 1;
+		opened[nopened++] = fd;
+		if (perf_leader == -1 &&
+		    perf_events[i].type != PERF_TYPE_HARDWARE) {
+			perf_fd[i] = fd;
+			continue;
+		}
+		if (perf_leader == -1) {
+			perf_leader = fd;
+		}
+		perf_idx[perf_nr++] = i;
+	}
+
+	if (!found) {
+		printf("perf_event_open failed: no counters available\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  read the current value of all counters
+*/
+void perf_read(uint64_t *counters)
+{
+	uint64_t buf[1 + NUM_PERF_COUNTERS];
+	ssize_t size = sizeof(uint64_t) * (1 + perf_nr);
+	int i;
+
+	memset(counters, 0, sizeof(uint64_t) * NUM_PERF_COUNTERS);
+	if (perf_leader != -1 && read(perf_leader, buf, size) == size) {
+		for (i = 0; i < perf_nr; i++) {
+			counters[perf_idx[i]] = buf[1 + i];
+		}
+	}
+	for (i = 0; i < NUM_PERF_COUNTERS; i++) {
+		if (perf_fd[i] != -1 &&
+		    read(perf_fd[i], buf, sizeof(uint64_t)) == sizeof(uint64_t)) {
+			counters[i] = buf[0];
+		}
+	}
+}
+
+#else
+
+int perf_setup(void)
+{
+	printf("perf counters are not supported on this platform\n");
+	return -1;
+}
+
+void perf_read(uint64_t *counters)
+{
+	memset(counters, 0, sizeof(uint64_t) * NUM_PERF_COUNTERS);
+}
+
+#endif
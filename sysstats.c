@@ -0,0 +1,269 @@
+/*
+   dbench system metrics
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Sample disk, writeback, vm, io pressure and network counters from
+   /proc on every reporting interval, so that latency spikes can be
+   matched against writeback and dirty throttling without running and
+   aligning a separate collector.
+*/
+
+#include "dbench.h"
+
+struct sys_stats {
+	struct timespec time;
+	uint64_t sectors_read;
+	uint64_t sectors_written;
+	uint64_t ios_in_progress;
+	uint64_t dirty_kb;
+	uint64_t writeback_kb;
+	uint64_t pgpgin;
+	uint64_t pgpgout;
+	uint64_t nr_dirtied;
+	uint64_t nr_written;
+	uint64_t io_some_usec;
+	uint64_t io_full_usec;
+	uint64_t net_rx_bytes;
+	uint64_t net_tx_bytes;
+};
+
+/* only count whole disks, partitions would count the same I/O twice. So
+   would device mapper and md devices, their I/O is counted on the disks
+   listed in their slaves directory */
+static int is_whole_disk(const char *name)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int stacked = 0;
+
+	if (strncmp(name, "loop", 4) == 0 || strncmp(name, "ram", 3) == 0) {
+		return 0;
+	}
+	snprintf(path, sizeof(path), "/sys/block/%s", name);
+	if (stat(path, &st) != 0) {
+		return 0;
+	}
+	snprintf(path, sizeof(path), "/sys/block/%s/slaves", name);
+	d = opendir(path);
+	if (d == NULL) {
+		return 1;
+	}
+	while ((de = readdir(d))) {
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+			stacked = 1;
+			break;
+		}
+	}
+	closedir(d);
+	return !stacked;
+}
+
+static void read_diskstats(struct sys_stats *s)
+{
+	unsigned long long rd_sec, wr_sec, in_progress, dummy;
+	char line[256], name[64];
+	FILE *f;
+
+	f = fopen("/proc/diskstats", "r");
+	if (f == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%llu %llu %63s %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+			   &dummy, &dummy, name, &dummy, &dummy, &rd_sec, &dummy,
+			   &dummy, &dummy, &wr_sec, &dummy, &in_progress) != 12) {
+			continue;
+		}
+		if (!is_whole_disk(name)) {
+			continue;
+		}
+		s->sectors_read += rd_sec;
+		s->sectors_written += wr_sec;
+		s->ios_in_progress += in_progress;
+	}
+	fclose(f);
+}
+
+static void read_meminfo(struct sys_stats *s)
+{
+	unsigned long long val;
+	char line[256];
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (f == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "Dirty: %llu", &val) == 1) {
+			s->dirty_kb = val;
+		} else if (sscanf(line, "Writeback: %llu", &val) == 1) {
+			s->writeback_kb = val;
+		}
+	}
+	fclose(f);
+}
+
+static void read_vmstat(struct sys_stats *s)
+{
+	unsigned long long val;
+	char line[256], name[64];
+	FILE *f;
+
+	f = fopen("/proc/vmstat", "r");
+	if (f == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63s %llu", name, &val) != 2) {
+			continue;
+		}
+		if (strcmp(name, "pgpgin") == 0) {
+			s->pgpgin = val;
+		} else if (strcmp(name, "pgpgout") == 0) {
+			s->pgpgout = val;
+		} else if (strcmp(name, "nr_dirtied") == 0) {
+			s->nr_dirtied = val;
+		} else if (strcmp(name, "nr_written") == 0) {
+			s->nr_written = val;
+		}
+	}
+	fclose(f);
+}
+
+static void read_pressure(struct sys_stats *s)
+{
+	unsigned long long total;
+	char line[256];
+	char *p;
+	FILE *f;
+
+	f = fopen("/proc/pressure/io", "r");
+	if (f == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		p = strstr(line, "total=");
+		if (p == NULL || sscanf(p, "total=%llu", &total) != 1) {
+			continue;
+		}
+		if (strncmp(line, "some", 4) == 0) {
+			s->io_some_usec = total;
+		} else if (strncmp(line, "full", 4) == 0) {
+			s->io_full_usec = total;
+		}
+	}
+	fclose(f);
+}
+
+static void read_netdev(struct sys_stats *s)
+{
+	unsigned long long rx, tx, dummy;
+	char line[512], name[64];
+	char *p;
+	FILE *f;
+
+	f = fopen("/proc/net/dev", "r");
+	if (f == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		p = strchr(line, ':');
+		if (p == NULL) {
+			continue;
+		}
+		*p = ' ';
+		if (sscanf(line, "%63s %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+			   name, &rx, &dummy, &dummy, &dummy, &dummy, &dummy,
+			   &dummy, &dummy, &tx) != 10) {
+			continue;
+		}
+		if (strcmp(name, "lo") == 0) {
+			continue;
+		}
+		s->net_rx_bytes += rx;
+		s->net_tx_bytes += tx;
+	}
+	fclose(f);
+}
+
+static void sys_stats_sample(struct sys_stats *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->time = timespec_current();
+	read_diskstats(s);
+	read_meminfo(s);
+	read_vmstat(s);
+	read_pressure(s);
+	read_netdev(s);
+}
+
+/*
+  sample the system metrics and print them as rates over the interval
+  since the previous call
+*/
+void sys_stats_report(void)
+{
+	static struct sys_stats prev;
+	struct sys_stats cur;
+	double t;
+
+	sys_stats_sample(&cur);
+	if (prev.time.tv_sec == 0) {
+		prev = cur;
+		return;
+	}
+	t = timespec_elapsed2(&prev.time, &cur.time);
+	if (t <= 0) {
+		return;
+	}
+
+/* counters can go backwards when a device or interface goes away */
+#define RATE(field) (cur.field < prev.field ? 0 : (cur.field - prev.field) / t)
+	if (options.machine_readable) {
+		printf("@S@%.2f@%.2f@%llu@%llu@%llu@%.0f@%.0f@%.0f@%.0f@%.2f@%.2f@%.2f@%.2f@\n",
+			RATE(sectors_read) * 512 * 1.0e-6,
+			RATE(sectors_written) * 512 * 1.0e-6,
+			(unsigned long long)cur.ios_in_progress,
+			(unsigned long long)cur.dirty_kb,
+			(unsigned long long)cur.writeback_kb,
+			RATE(pgpgin), RATE(pgpgout),
+			RATE(nr_dirtied), RATE(nr_written),
+			RATE(io_some_usec) * 1.0e-4, RATE(io_full_usec) * 1.0e-4,
+			RATE(net_rx_bytes) * 1.0e-6, RATE(net_tx_bytes) * 1.0e-6);
+	} else {
+		printf("      disk %.2f/%.2f MB/sec r/w  inflight %llu  "
+		       "dirty %llu kB  writeback %llu kB  "
+		       "pgpgin/pgpgout %.0f/%.0f per sec  "
+		       "dirtied/written %.0f/%.0f pages/sec  "
+		       "io pressure %.1f%%/%.1f%% some/full  "
+		       "net %.2f/%.2f MB/sec rx/tx\n",
+			RATE(sectors_read) * 512 * 1.0e-6,
+			RATE(sectors_written) * 512 * 1.0e-6,
+			(unsigned long long)cur.ios_in_progress,
+			(unsigned long long)cur.dirty_kb,
+			(unsigned long long)cur.writeback_kb,
+			RATE(pgpgin), RATE(pgpgout),
+			RATE(nr_dirtied), RATE(nr_written),
+			RATE(io_some_usec) * 1.0e-4, RATE(io_full_usec) * 1.0e-4,
+			RATE(net_rx_bytes) * 1.0e-6, RATE(net_tx_bytes) * 1.0e-6);
+	}
+#undef RATE
+
+	prev = cur;
+}
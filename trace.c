@@ -0,0 +1,249 @@
+/*
+   dbench per operation trace
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Record every operation into a buffer of each client and append the
+   buffer to the trace file as one chunk when it is full. The file is
+   opened with O_APPEND before the children are forked, so each chunk is
+   written with a single write() and chunks of different clients never
+   interleave. File names and status strings are written once per client
+   and referenced by id, which keeps the records at a fixed 40 bytes.
+
+   The trace is analysed with dbench-trace.
+*/
+
+#include "dbench.h"
+
+#define TRACE_BUF_SIZE (1024*1024)
+#define TRACE_NAME_HASH 4096
+
+struct trace_name_ent {
+	struct trace_name_ent *next;
+	uint32_t hash;
+	uint32_t id;
+	char name[1];
+};
+
+struct trace_buf {
+	char *buf;
+	size_t used;
+	uint32_t next_id;
+	/* the id of the first operation of the backend of the client */
+	unsigned op_base;
+	struct trace_name_ent *names[TRACE_NAME_HASH];
+};
+
+static int trace_fd = -1;
+static unsigned op_base[MAX_BACKENDS];
+
+static size_t trace_name_size(size_t len)
+{
+	return sizeof(struct trace_name) +
+		((len + 1 + TRACE_ALIGN - 1) & ~(size_t)(TRACE_ALIGN - 1));
+}
+
+static void trace_put_name(char *p, uint16_t type, uint32_t id,
+			   const char *name, size_t len)
+{
+	struct trace_name *n = (struct trace_name *)p;
+
+	memset(p, 0, trace_name_size(len));
+	n->type = type;
+	n->id = id;
+	n->len = len;
+	memcpy(p + sizeof(*n), name, len);
+}
+
+/* the name of an operation, qualified by the backend in mixed runs */
+static const char *trace_op_name(struct nb_operations *backend, unsigned op,
+				 char *buf, size_t size)
+{
+	if (num_backends == 1) {
+		return backend->ops[op].name;
+	}
+	snprintf(buf, size, "%s/%s", backend->backend_name, backend->ops[op].name);
+	return buf;
+}
+
+/*
+  create the trace file and write the header and the operation names of
+  the backends. Returns 0 on success
+*/
+int trace_open(const char *fname)
+{
+	struct trace_header hdr;
+	char *buf, *p;
+	size_t size = sizeof(hdr);
+	char name[64];
+	unsigned i, n = 0;
+	ssize_t ret;
+	int b;
+
+	trace_fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+	if (trace_fd == -1) {
+		printf("failed to create trace file %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	for (b = 0; b < num_backends; b++) {
+		op_base[b] = n;
+		for (i = 0; backends[b]->ops[i].name; i++, n++) {
+			size += trace_name_size(strlen(trace_op_name(backends[b], i,
+								     name, sizeof(name))));
+		}
+	}
+	hdr.num_ops = n;
+
+	p = buf = malloc(size);
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	for (b = 0; b < num_backends; b++) {
+		for (i = 0; backends[b]->ops[i].name; i++) {
+			const char *opname = trace_op_name(backends[b], i, name, sizeof(name));
+			size_t len = strlen(opname);
+
+			trace_put_name(p, TRACE_OPNAME, op_base[b] + i, opname, len);
+			p += trace_name_size(len);
+		}
+	}
+	ret = write(trace_fd, buf, size);
+	free(buf);
+	if (ret != (ssize_t)size) {
+		printf("failed to write trace file %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  allocate the trace buffer of a client, in the client process
+*/
+void trace_setup(struct child_struct *child)
+{
+	struct trace_buf *tb;
+	int b;
+
+	tb = calloc(1, sizeof(*tb));
+	tb->buf = mmap(NULL, TRACE_BUF_SIZE, PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (tb->buf == MAP_FAILED) {
+		printf("failed to allocate trace buffer: %s\n", strerror(errno));
+		exit(1);
+	}
+	tb->next_id = 1;
+	for (b = 0; b < num_backends; b++) {
+		if (backends[b] == child->backend) {
+			tb->op_base = op_base[b];
+		}
+	}
+	child->trace = tb;
+}
+
+/*
+  append the buffered records of a client to the trace file
+*/
+void trace_flush(struct child_struct *child)
+{
+	struct trace_buf *tb = child->trace;
+	struct trace_chunk chunk;
+	struct iovec iov[2];
+
+	if (tb == NULL || tb->used == 0) {
+		return;
+	}
+	chunk.client = child->id;
+	chunk.size = tb->used;
+	iov[0].iov_base = &chunk;
+	iov[0].iov_len = sizeof(chunk);
+	iov[1].iov_base = tb->buf;
+	iov[1].iov_len = tb->used;
+	if (writev(trace_fd, iov, 2) != (ssize_t)(sizeof(chunk) + tb->used)) {
+		printf("[%d] failed to write trace: %s\n", child->line, strerror(errno));
+		exit(1);
+	}
+	tb->used = 0;
+}
+
+static void *trace_space(struct child_struct *child, size_t size)
+{
+	struct trace_buf *tb = child->trace;
+	void *p;
+
+	if (tb->used + size > TRACE_BUF_SIZE) {
+		trace_flush(child);
+	}
+	p = tb->buf + tb->used;
+	tb->used += size;
+	return p;
+}
+
+/* return the id of a name, writing a name record the first time a
+   client uses it */
+static uint32_t trace_name_id(struct child_struct *child, const char *name)
+{
+	struct trace_buf *tb = child->trace;
+	struct trace_name_ent *e;
+	uint32_t hash = 5381;
+	size_t len;
+
+	if (name == NULL || name[0] == 0) {
+		return 0;
+	}
+	for (len = 0; name[len]; len++) {
+		hash = hash * 33 + (unsigned char)name[len];
+	}
+	for (e = tb->names[hash % TRACE_NAME_HASH]; e; e = e->next) {
+		if (e->hash == hash && strcmp(e->name, name) == 0) {
+			return e->id;
+		}
+	}
+
+	e = malloc(sizeof(*e) + len);
+	e->hash = hash;
+	e->id = tb->next_id++;
+	memcpy(e->name, name, len + 1);
+	e->next = tb->names[hash % TRACE_NAME_HASH];
+	tb->names[hash % TRACE_NAME_HASH] = e;
+
+	trace_put_name(trace_space(child, trace_name_size(len)),
+		       TRACE_NAME, e->id, name, len);
+	return e->id;
+}
+
+/*
+  record an operation that started at child->lasttime and finished at
+  end. The status is the one the loadfile expected, the backends do not
+  return the status they got
+*/
+void trace_op(struct child_struct *child, unsigned op, const char *fname,
+	      const char *status, double bytes, uint64_t end)
+{
+	uint32_t file = trace_name_id(child, fname);
+	uint32_t st = trace_name_id(child, status);
+	struct trace_op *r = trace_space(child, sizeof(*r));
+
+	r->type = TRACE_OP;
+	r->op = ((struct trace_buf *)child->trace)->op_base + op;
+	r->line = child->line;
+	r->file = file;
+	r->status = st;
+	r->start = child->lasttime;
+	r->duration = end - child->lasttime;
+	r->bytes = bytes;
+}
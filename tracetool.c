@@ -0,0 +1,439 @@
+/*
+   dbench-trace - analyse the trace files written by dbench --trace
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dbench.h"
+
+/* width of the heatmap and timeline in columns */
+#define TRACE_COLUMNS 72
+
+static const char shades[] = HEATMAP_SHADES;
+#define NUM_SHADES (sizeof(shades) - 1)
+
+struct record {
+	unsigned client;
+	unsigned op;
+	unsigned line;
+	const char *fname;
+	const char *status;
+	uint64_t start;
+	uint64_t duration;
+	uint64_t bytes;
+};
+
+/* util.c refers to the options of dbench */
+struct options options;
+
+static const char **op_names;
+static unsigned num_ops;
+static struct record *records;
+static unsigned num_records;
+static unsigned num_clients;
+static uint64_t trace_start, trace_end;
+
+struct client_names {
+	const char **names;
+	unsigned num;
+};
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (p == NULL) {
+		printf("out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static void corrupt(const char *fname)
+{
+	printf("%s: corrupt trace file\n", fname);
+	exit(1);
+}
+
+static char *load_file(const char *fname, size_t *size)
+{
+	struct stat st;
+	char *buf;
+	FILE *f;
+
+	f = fopen(fname, "r");
+	if (f == NULL || fstat(fileno(f), &st) != 0) {
+		printf("failed to open %s: %s\n", fname, strerror(errno));
+		exit(1);
+	}
+	buf = xrealloc(NULL, st.st_size + 1);
+	if (fread(buf, 1, st.st_size, f) != (size_t)st.st_size) {
+		printf("failed to read %s\n", fname);
+		exit(1);
+	}
+	fclose(f);
+	*size = st.st_size;
+	return buf;
+}
+
+/* size of a name record including the padded name */
+static size_t name_size(const struct trace_name *n)
+{
+	return sizeof(*n) + ((n->len + 1 + TRACE_ALIGN - 1) & ~(size_t)(TRACE_ALIGN - 1));
+}
+
+static void load_trace(const char *fname)
+{
+	struct client_names *names = NULL;
+	struct trace_header *hdr;
+	unsigned allocated = 0;
+	size_t size, ofs;
+	char *buf;
+
+	buf = load_file(fname, &size);
+	hdr = (struct trace_header *)buf;
+	if (size < sizeof(*hdr) || memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0) {
+		printf("%s is not a dbench trace file\n", fname);
+		exit(1);
+	}
+	if (hdr->version != TRACE_VERSION) {
+		printf("%s: unsupported trace version %u\n", fname, hdr->version);
+		exit(1);
+	}
+
+	num_ops = hdr->num_ops;
+	op_names = xrealloc(NULL, num_ops * sizeof(char *));
+	ofs = sizeof(*hdr);
+	while (ofs + sizeof(struct trace_name) <= size &&
+	       ((struct trace_name *)(buf + ofs))->type == TRACE_OPNAME) {
+		struct trace_name *n = (struct trace_name *)(buf + ofs);
+
+		if (n->id >= num_ops || ofs + name_size(n) > size) {
+			corrupt(fname);
+		}
+		op_names[n->id] = buf + ofs + sizeof(*n);
+		ofs += name_size(n);
+	}
+
+	while (ofs + sizeof(struct trace_chunk) <= size) {
+		struct trace_chunk *chunk = (struct trace_chunk *)(buf + ofs);
+		struct client_names *cn;
+		size_t end;
+
+		ofs += sizeof(*chunk);
+		end = ofs + chunk->size;
+		if (end > size) {
+			corrupt(fname);
+		}
+		if (chunk->client >= num_clients) {
+			names = xrealloc(names, (chunk->client + 1) * sizeof(*names));
+			memset(names + num_clients, 0,
+			       (chunk->client + 1 - num_clients) * sizeof(*names));
+			num_clients = chunk->client + 1;
+		}
+		cn = &names[chunk->client];
+
+		while (ofs < end) {
+			uint16_t type = *(uint16_t *)(buf + ofs);
+
+			if (type == TRACE_NAME) {
+				struct trace_name *n = (struct trace_name *)(buf + ofs);
+
+				if (ofs + name_size(n) > end) {
+					corrupt(fname);
+				}
+				if (n->id >= cn->num) {
+					cn->names = xrealloc(cn->names, (n->id + 1) * sizeof(char *));
+					memset(cn->names + cn->num, 0,
+					       (n->id + 1 - cn->num) * sizeof(char *));
+					cn->num = n->id + 1;
+				}
+				cn->names[n->id] = buf + ofs + sizeof(*n);
+				ofs += name_size(n);
+			} else if (type == TRACE_OP) {
+				struct trace_op *r = (struct trace_op *)(buf + ofs);
+				struct record *rec;
+
+				if (ofs + sizeof(*r) > end || r->op >= num_ops ||
+				    (r->file && r->file >= cn->num) ||
+				    (r->status && r->status >= cn->num)) {
+					corrupt(fname);
+				}
+				if (num_records == allocated) {
+					allocated = allocated ? allocated * 2 : 65536;
+					records = xrealloc(records, allocated * sizeof(*records));
+				}
+				rec = &records[num_records++];
+				rec->client = chunk->client;
+				rec->op = r->op;
+				rec->line = r->line;
+				rec->fname = r->file ? cn->names[r->file] : "";
+				rec->status = r->status ? cn->names[r->status] : "";
+				rec->start = r->start;
+				rec->duration = r->duration;
+				rec->bytes = r->bytes;
+
+				if (trace_start == 0 || r->start < trace_start) {
+					trace_start = r->start;
+				}
+				if (r->start + r->duration > trace_end) {
+					trace_end = r->start + r->duration;
+				}
+				ofs += sizeof(*r);
+			} else {
+				corrupt(fname);
+			}
+		}
+	}
+
+	if (num_records == 0) {
+		printf("%s contains no operations\n", fname);
+		exit(1);
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void show_summary(void)
+{
+	uint64_t *lat = xrealloc(NULL, num_records * sizeof(uint64_t));
+	double span = (trace_end - trace_start) * 1.0e-9;
+	uint64_t bytes = 0;
+	unsigned op, i, n;
+
+	for (i = 0; i < num_records; i++) {
+		bytes += records[i].bytes;
+	}
+	printf("%u operations from %u clients over %.3f sec, %.2f MB/sec\n\n",
+	       num_records, num_clients, span, span > 0 ? 1.0e-6 * bytes / span : 0);
+
+	printf(" Operation                Count    AvgLat    P50Lat    P99Lat    MaxLat\n");
+	printf(" ----------------------------------------------------------------------\n");
+	for (op = 0; op < num_ops; op++) {
+		double total = 0;
+
+		for (n = i = 0; i < num_records; i++) {
+			if (records[i].op == op) {
+				lat[n++] = records[i].duration;
+				total += records[i].duration;
+			}
+		}
+		if (n == 0) {
+			continue;
+		}
+		qsort(lat, n, sizeof(uint64_t), cmp_u64);
+		printf(" %-22s %7u %9.03f %9.03f %9.03f %9.03f\n",
+		       op_names[op], n, 1.0e-6 * total / n,
+		       1.0e-6 * lat[n / 2], 1.0e-6 * lat[(n - 1) * 99 / 100],
+		       1.0e-6 * lat[n - 1]);
+	}
+	free(lat);
+}
+
+static int find_op(const char *name)
+{
+	unsigned op;
+
+	for (op = 0; op < num_ops; op++) {
+		if (strcasecmp(op_names[op], name) == 0) {
+			return op;
+		}
+	}
+	printf("no operation %s in the trace\n", name);
+	exit(1);
+}
+
+static unsigned time_slot(uint64_t t)
+{
+	unsigned slot = (t - trace_start) * TRACE_COLUMNS / (trace_end - trace_start + 1);
+	return MIN(slot, TRACE_COLUMNS - 1);
+}
+
+/*
+  latency over time: one column per time slot, one row per power of two
+  of latency
+*/
+static void show_heatmap(const char *opname)
+{
+	static unsigned map[LAT_HIST_BUCKETS][TRACE_COLUMNS];
+	int op = opname ? find_op(opname) : -1;
+	int lo = LAT_HIST_BUCKETS, hi = -1, b;
+	unsigned i, max = 0;
+
+	for (i = 0; i < num_records; i++) {
+		struct record *r = &records[i];
+
+		if (op != -1 && r->op != (unsigned)op) {
+			continue;
+		}
+		b = latency_bucket(r->duration * 1.0e-9);
+		map[b][time_slot(r->start)]++;
+		max = MAX(max, map[b][time_slot(r->start)]);
+		lo = MIN(lo, b);
+		hi = MAX(hi, b);
+	}
+	if (hi == -1) {
+		printf("no %s operations in the trace\n", opname);
+		return;
+	}
+
+	printf("latency of %s operations over %.3f sec, max %u per cell\n\n",
+	       opname ? opname : "all", (trace_end - trace_start) * 1.0e-9, max);
+	for (b = hi; b >= lo; b--) {
+		printf(" <%9.03f ms |", latency_bucket_limit(b) * 1000);
+		for (i = 0; i < TRACE_COLUMNS; i++) {
+			putchar(heatmap_shade(map[b][i], max));
+		}
+		printf("|\n");
+	}
+}
+
+struct file_stats {
+	const char *fname;
+	unsigned count;
+	double total_time;
+	double max_latency;
+	uint64_t bytes;
+};
+
+static int cmp_fname(const void *a, const void *b)
+{
+	return strcmp((*(struct record * const *)a)->fname,
+		      (*(struct record * const *)b)->fname);
+}
+
+static int cmp_total_time(const void *a, const void *b)
+{
+	double x = ((const struct file_stats *)a)->total_time;
+	double y = ((const struct file_stats *)b)->total_time;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+  the files the most time was spent on
+*/
+static void show_files(unsigned limit)
+{
+	struct record **sorted = xrealloc(NULL, num_records * sizeof(*sorted));
+	struct file_stats *files = xrealloc(NULL, num_records * sizeof(*files));
+	unsigned i, n = 0;
+
+	for (i = 0; i < num_records; i++) {
+		sorted[i] = &records[i];
+	}
+	qsort(sorted, num_records, sizeof(*sorted), cmp_fname);
+
+	for (i = 0; i < num_records; i++) {
+		struct record *r = sorted[i];
+		double t = r->duration * 1.0e-9;
+
+		if (r->fname[0] == 0) {
+			continue;
+		}
+		if (n == 0 || strcmp(files[n-1].fname, r->fname) != 0) {
+			memset(&files[n], 0, sizeof(files[n]));
+			files[n++].fname = r->fname;
+		}
+		files[n-1].count++;
+		files[n-1].total_time += t;
+		files[n-1].max_latency = MAX(files[n-1].max_latency, t);
+		files[n-1].bytes += r->bytes;
+	}
+	qsort(files, n, sizeof(*files), cmp_total_time);
+
+	printf("    Count   TotalTime    MaxLat        MB  File\n");
+	printf(" -----------------------------------------------------------------\n");
+	for (i = 0; i < n && i < limit; i++) {
+		printf(" %8u %9.03f s %9.03f %9.2f  %s\n",
+		       files[i].count, files[i].total_time,
+		       files[i].max_latency * 1000, files[i].bytes * 1.0e-6,
+		       files[i].fname);
+	}
+	free(files);
+	free(sorted);
+}
+
+/*
+  per client timeline: the fraction of each time slot a client spent
+  inside operations. Gaps show clients that were sleeping or starved
+*/
+static void show_timeline(void)
+{
+	double slot_len = (double)(trace_end - trace_start + 1) / TRACE_COLUMNS;
+	double *busy = xrealloc(NULL, num_clients * TRACE_COLUMNS * sizeof(double));
+	unsigned i, c;
+
+	memset(busy, 0, num_clients * TRACE_COLUMNS * sizeof(double));
+	for (i = 0; i < num_records; i++) {
+		struct record *r = &records[i];
+		uint64_t t = r->start, end = r->start + r->duration;
+		unsigned s;
+
+		for (s = time_slot(t); s < TRACE_COLUMNS && t < end; s++) {
+			uint64_t slot_end = trace_start + (uint64_t)((s + 1) * slot_len);
+			uint64_t e = MIN(end, slot_end);
+
+			if (e > t) {
+				busy[r->client * TRACE_COLUMNS + s] += e - t;
+				t = e;
+			}
+		}
+	}
+
+	printf("fraction of time spent in operations over %.3f sec\n\n",
+	       (trace_end - trace_start) * 1.0e-9);
+	for (c = 0; c < num_clients; c++) {
+		printf(" client %4u |", c);
+		for (i = 0; i < TRACE_COLUMNS; i++) {
+			double f = busy[c * TRACE_COLUMNS + i] / slot_len;
+
+			putchar(f > 0 ? shades[1 + (unsigned)(MIN(f, 1.0) * (NUM_SHADES - 2) + 0.5)] : ' ');
+		}
+		printf("|\n");
+	}
+	free(busy);
+}
+
+static void usage(void)
+{
+	printf("usage: dbench-trace summary TRACEFILE\n"
+	       "       dbench-trace heatmap TRACEFILE [OPERATION]\n"
+	       "       dbench-trace files TRACEFILE [COUNT]\n"
+	       "       dbench-trace timeline TRACEFILE\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		usage();
+	}
+	load_trace(argv[2]);
+
+	if (strcmp(argv[1], "summary") == 0) {
+		show_summary();
+	} else if (strcmp(argv[1], "heatmap") == 0) {
+		show_heatmap(argc > 3 ? argv[3] : NULL);
+	} else if (strcmp(argv[1], "files") == 0) {
+		show_files(argc > 3 ? atoi(argv[3]) : 20);
+	} else if (strcmp(argv[1], "timeline") == 0) {
+		show_timeline();
+	} else {
+		usage();
+	}
+	return 0;
+}
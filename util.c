@@ -17,6 +17,11 @@
 */
 
 #include "dbench.h"
+#include <math.h>
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 
@@ -185,6 +190,197 @@ double timeval_elapsed2(struct timeval *tv1, struct timeval *tv2)
 
 
 
+/*
+  return the current time in nanoseconds. This is used to timestamp every
+  operation so it must be cheap, and it must not jump or be slewed when
+  NTP adjusts the wall clock.
+*/
+uint64_t nsec_current(void)
+{
+        struct timespec ts;
+        clock_gettime(OP_CLOCK, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+  return the number of seconds elapsed since a nsec_current() timestamp
+*/
+double nsec_elapsed(uint64_t t)
+{
+        return (nsec_current() - t) * 1.0e-9;
+}
+
+/*
+  return the latency histogram bucket for a latency of t seconds
+*/
+int latency_bucket(double t)
+{
+        uint64_t usec = t * 1.0e6;
+        int bucket;
+
+        if (usec == 0) {
+                return 0;
+        }
+        bucket = 64 - __builtin_clzll(usec);
+        return MIN(bucket, LAT_HIST_BUCKETS - 1);
+}
+
+/*
+  return the upper limit of a latency histogram bucket in seconds
+*/
+double latency_bucket_limit(int bucket)
+{
+        return (1ULL << bucket) * 1.0e-6;
+}
+
+/*
+  return the latency below which pct percent of the samples in a
+  histogram fall, as the upper limit of the bucket holding that sample
+*/
+double latency_percentile(const unsigned *hist, double pct)
+{
+        uint64_t total = 0, sum = 0;
+        int i;
+
+        for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+                total += hist[i];
+        }
+        if (total == 0) {
+                return 0;
+        }
+        for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+                sum += hist[i];
+                if (sum >= total * pct / 100) {
+                        break;
+                }
+        }
+        return latency_bucket_limit(MIN(i, LAT_HIST_BUCKETS - 1));
+}
+
+/*
+  the character for a heatmap cell, on a log scale of the count relative
+  to the largest cell so that rare outliers stay visible
+*/
+char heatmap_shade(double count, double max)
+{
+        static const char shades[] = HEATMAP_SHADES;
+        const int n = sizeof(shades) - 1;
+
+        if (count <= 0) {
+                return shades[0];
+        }
+        if (max <= 1) {
+                return shades[n - 1];
+        }
+        return shades[1 + (int)((n - 2) * log(count) / log(max) + 0.5)];
+}
+
+/*
+  return a timespec for the current CLOCK_MONOTONIC time
+*/
+struct timespec timespec_current(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts;
+}
+
+/*
+  return the number of seconds elapsed since a given time
+*/
+double timespec_elapsed(struct timespec *ts)
+{
+        struct timespec ts2 = timespec_current();
+        return timespec_elapsed2(ts, &ts2);
+}
+
+/*
+  return the number of seconds elapsed between two times
+*/
+double timespec_elapsed2(struct timespec *ts1, struct timespec *ts2)
+{
+        return (ts2->tv_sec - ts1->tv_sec) + 
+               (ts2->tv_nsec - ts1->tv_nsec)*1.0e-9;
+}
+
+/*
+  move a timespec forward by t seconds
+*/
+void timespec_add(struct timespec *ts, double t)
+{
+        long sec = (long)t;
+
+        ts->tv_sec += sec;
+        ts->tv_nsec += (long)((t - sec) * 1.0e9);
+        while (ts->tv_nsec >= 1000000000) {
+                ts->tv_sec++;
+                ts->tv_nsec -= 1000000000;
+        }
+        while (ts->tv_nsec < 0) {
+                ts->tv_sec--;
+                ts->tv_nsec += 1000000000;
+        }
+}
+
+/*
+  Sleep until an absolute CLOCK_MONOTONIC deadline. The last
+  options.pacing_spin microseconds are spent busy-waiting on the clock
+  since waking from clock_nanosleep() is only accurate to the timer slack
+  of the kernel.
+
+  Returns how many seconds after the deadline we actually woke up.
+*/
+double sleep_until(struct timespec *deadline)
+{
+        struct timespec wake = *deadline;
+        struct timespec now;
+
+        if (options.pacing_spin > 0) {
+                timespec_add(&wake, -1.0e-6 * options.pacing_spin);
+        }
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+                ;
+
+        do {
+                now = timespec_current();
+        } while (options.pacing_spin > 0 && timespec_elapsed2(deadline, &now) < 0);
+
+        return timespec_elapsed2(deadline, &now);
+}
+
+/*
+  wait for at most timeout seconds until *addr no longer holds val and
+  futex_wake() is called on it. This works across processes on shared
+  memory. Without futexes it polls every millisecond
+*/
+void futex_wait(int *addr, int val, double timeout)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+        struct timespec ts;
+
+        ts.tv_sec = timeout;
+        ts.tv_nsec = (timeout - ts.tv_sec) * 1.0e9;
+        syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+        if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val) {
+                usleep(1000);
+        }
+#endif
+}
+
+/*
+  wake all processes waiting in futex_wait() on addr
+*/
+void futex_wake(int *addr)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+        syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+        (void)addr;
+#endif
+}
+
 /**
  Sleep for a specified number of milliseconds.
 **/